@@ -20,14 +20,35 @@ APClient._VERSION = "0.6.4"
 ---@param uuid string a string identifying connection or `""`
 ---@param game string name of the game this client will connect for
 ---@param host string URL or `host:port` to connect to
+---@param cert_store string? path to a PEM file of trusted CA certificates for wss, defaults to `set_default_cert_store`
 ---@return APClient
-function APClient.__call(uuid, game, host) end
+function APClient.__call(uuid, game, host, cert_store) end
+
+---Set the CA certificates used by clients that are created without `cert_store`. Applies to the whole process.
+---@param path string? path to a PEM file or nil to use the system's certificates
+function APClient.set_default_cert_store(path) end
+
+---Connect to a host without scheme by racing wss and ws, and keep the first one that receives RoomInfo.
+---Returns an object that has to be polled instead of the client until it returns the winning client.
+---@param uuid string a string identifying connection or `""`
+---@param game string name of the game this client will connect for
+---@param host string `host:port` to connect to; with a scheme only that one is tried
+---@param stagger number? seconds before ws is tried after wss, default 0.25
+---@param cert_store string? see `APClient.__call`
+---@return APClientRace
+function APClient.race(uuid, game, host, stagger, cert_store) end
+
+---Create an empty group of clients that can be polled with a single call.
+---@return APClientGroup
+function APClient.group() end
 
 
 -- Methods --
 
 ---Call this repeatedly (e.g. once per frame) to handle network communication.
 ---This will call registered callbacks/handlers.
+---Has to be called from the coroutine, or main thread, that created the client. Otherwise it raises
+---"Multi-threading not supported".
 function APClient:poll() end
 
 ---Clear state and reconnect on next Poll().
@@ -128,6 +149,107 @@ function APClient:get_permissions() end
 ---@return permission?
 function APClient:get_permission(key) end
 
+---Get locally mirrored value of a data storage key without asking the server.
+---The mirror is updated from Retrieved and SetReply, and keys passed to SetNotify are re-subscribed on reconnect.
+---The mirror and the SetNotify keys are cleared by `reset()` and when connecting to a different slot or room.
+---@param key string
+---@return any value value or nil if unknown
+---@return integer version incremented when the value changes, 0 if unknown
+function APClient:storage_get(key) end
+
+---Set how the client reconnects after losing or failing to establish the connection, or nil for the default.
+---Delays double with every failed attempt, from `min_delay` up to `max_delay` seconds, varied by `jitter`.
+---After `max_attempts` failed attempts the socket error handler is called and the client stays disconnected
+---until `reset()`. State such as the data package and checked locations is kept across reconnects.
+---@param policy ReconnectPolicy|nil
+function APClient:set_reconnect_policy(policy) end
+
+---Keep received items for `save_state`, or drop them. Disabled by default, enabled by `load_state`.
+---Enabling it while connected sends `Sync` to get the items that were received before. They are not passed to the
+---items received handler again.
+---@param enabled boolean
+function APClient:set_item_log_enabled(enabled) end
+
+---Save received items, checked locations and data package checksums to a binary file for `load_state`.
+---Received items are only saved while `set_item_log_enabled` is on.
+---@param path string
+function APClient:save_state(path) end
+
+---Load a file written by `save_state`, preferably before connecting. Items in it will not be passed to the
+---items received handler again when the server resends them for the same slot. Raises an error if the file is
+---invalid or, while connected, for a different slot.
+---@param path string
+---@return table<string, string> checksums data package checksums by game at the time of saving
+function APClient:load_state(path) end
+
+---Keep the journal of checks made while disconnected in an append-only file that is synced on every write, or only
+---in memory if path is nil. Checks left in the file by a previous run are restored and sent when connected.
+---The file names the slot the checks were made for. Checks made for a different slot or room are discarded when
+---connecting, and raise an error when restored on top of unsent checks for another slot.
+---@param path string|nil
+function APClient:set_check_journal(path) end
+
+---Get the number of checks in the journal that were not sent yet.
+---@return integer
+function APClient:get_check_journal_size() end
+
+---Record all events received from the server with timestamps to a binary file, or stop recording if path is nil.
+---Only events that would call a handler at that time are recorded.
+---@param path string|nil
+function APClient:set_capture(path) end
+
+---Feed events recorded by `set_capture` into the handlers without a socket, e.g. to profile handlers.
+---Handlers are called directly, an error in a handler is raised after the replay.
+---Only handlers run: the check journal, data storage mirror, item log, location tables, pending requests and the
+---shared data package are left untouched, so it is safe to replay on a client that is in use.
+---@param path string
+---@param realtime boolean? keep the original timing instead of replaying as fast as possible
+---@return integer count number of events replayed
+function APClient:replay(path, realtime) end
+
+---Enable or disable timing of handler calls. Disabled by default.
+---@param enabled boolean
+function APClient:set_stats_enabled(enabled) end
+
+---Get handler timing collected while stats were enabled, by handler name, e.g. `items_received_handler`.
+---@return table<string, HandlerStats>
+function APClient:get_stats() end
+
+---Clear handler timing.
+function APClient:reset_stats() end
+
+---Get an estimate of the native memory held by the client in bytes by category. Receive buffers, zlib and TLS state
+---of the socket are not included. The data package is the copy that each client keeps.
+---@return MemoryUsage
+function APClient:get_memory_usage() end
+
+---Report handler calls that take longer than budget seconds to callback, or to a rate-limited log if callback is nil.
+---nil or 0 disables the check. Calls over budget are also counted in `get_stats`.
+---With yieldable handlers, a call is checked when it returns without yielding. A handler that yields gives control
+---back to the caller, so the time until it is resumed does not count.
+---@param budget number|nil seconds
+---@param callback fun(name: string, duration: number)|nil name of the handler, e.g. `items_received_handler`, and seconds
+function APClient:set_handler_budget(budget, callback) end
+
+---Get poll and event counters. These are always collected. Times are in seconds.
+---@return Metrics
+function APClient:get_metrics() end
+
+---Record spans of polls, received events, handler calls and sent commands into a ring buffer that keeps the last
+---capacity spans. nil or 0 disables tracing and discards recorded spans.
+---@param capacity integer|nil
+function APClient:set_tracing(capacity) end
+
+---Write the recorded spans as Chrome Trace Event JSON that can be loaded into Perfetto or chrome://tracing.
+---@param path string
+---@return integer count number of spans written
+function APClient:dump_trace(path) end
+
+---Get connection statistics. Times are in seconds from starting to connect until receiving RoomInfo.
+---This only collects statistics; reconnects do not resume the previous TLS session.
+---@return ConnectionStats
+function APClient:get_connection_stats() end
+
 
 -- Member variables --
 
@@ -198,6 +320,18 @@ function APClient:set_print_json_handler(callback) end
 ---@param callback fun(command:{[string]: any}):nil
 function APClient:set_bounced_handler(callback) end
 
+---Callback will be called when a Bounced message with the given tag was received, e.g. `"DeathLink"`.
+---Only `data` of the command is passed. Bounces that match a tag handler are not passed to the bounced handler.
+---@param tag string tag to match
+---@param callback fun(data:{[string]: any}):nil|nil callback or nil to remove the handler for the tag
+function APClient:set_bounced_tag_handler(tag, callback) end
+
+---Enable or disable dropping Bounced messages that are the echo of our own Bounce.
+---While enabled, table data sent with `Bounce` gets a `_lua_apclientpp_bounce` nonce that identifies the echo, so
+---identical data from other clients still arrives. Other data is not tracked and its echo is not dropped.
+---@param enabled boolean
+function APClient:set_bounce_echo_suppression(enabled) end
+
 ---Callback will be called as response to Get.
 ---`data` is a key-value table for the requested keys.
 ---`keys` is the list of the requested keys. This is required because keys will not be existent in data for `nil` values.
@@ -209,6 +343,14 @@ function APClient:set_retrieved_handler(callback) end
 ---@param callback fun(command:{[string]:any}):nil
 function APClient:set_set_reply_handler(callback) end
 
+---Enable or disable yieldable handlers. Requires Lua 5.2+.
+---When enabled, handlers triggered by `poll` run after the network code returned and may `coroutine.yield`.
+---The yield suspends `poll`, resuming the coroutine continues the handler and the remaining handlers.
+---`poll` has to be called from the coroutine that created the client. Calling `poll` from a handler raises an error.
+---@param enabled boolean
+---@return boolean supported false on Lua 5.1 and LuaJIT
+function APClient:set_yieldable_handlers(enabled) end
+
 
 -- Commands --
 
@@ -251,8 +393,12 @@ function APClient:Bounce(data, games, slots, tags) end
 function APClient:StatusUpdate(status) end
 
 ---Report locations as checked/looted to the server.
+---Locations that are already checked are not sent again. If nothing new remains, no message is sent.
+---While not connected to a slot, new locations are added to the check journal and sent in one packet once connected.
 ---@param locations integer[] location IDs that were checked.
----@return boolean true if message was queued
+---@return boolean true if message was queued or journaled, or there was nothing to send
+---@return integer sent number of location IDs sent or journaled
+---@return integer suppressed number of location IDs that were dropped as already checked or duplicate
 function APClient:LocationChecks(locations) end
 
 ---Query the server for location details. Server will send LocationInfo asynchronously. 
@@ -276,10 +422,13 @@ function APClient:UpdateHint(player, location, status) end
 function APClient:CreateHints(locations, target_player, status) end
 
 ---Query the server for keys in data storage. Server will asynchronously reply with Retrieved.
+---If a callback is given, the reply is passed to it instead of the retrieved handler.
+---Can be called as `Get(keys, callback)` or `Get(keys, extra, callback)`.
 ---@param keys string[] keys to query
 ---@param extra {[string]: any}? Additional data to send in the command. Will be included in Retrieved. 
+---@param callback fun(data:{[string]: any}, command:{[string]: any})? optional callback for the reply
 ---@return boolean true if message was queued
-function APClient:Get(keys, extra) end
+function APClient:Get(keys, extra, callback) end
 
 ---Listen to changes of keys in data storage. Server will send SetReply when they change.
 ---@param keys string[] keys to watch
@@ -292,10 +441,44 @@ function APClient:SetNotify(keys) end
 ---@param want_reply boolean true to receive SetReply without SetNotify
 ---@param operations {[string]: any}[] operations to change value
 ---@param extra {[string]: any}? Additional data to send in the command. Will be included in SetReply.
+---@param callback fun(command:{[string]: any})? optional callback for the reply, implies want_reply.
+---If a callback is given, the reply is passed to it instead of the set_reply handler.
+---Can be called with or without `extra`.
 ---@return boolean true if message was queued
-function APClient:Set(key, default, want_reply, operations, extra) end
+function APClient:Set(key, default, want_reply, operations, extra, callback) end
+
 
 
+-- Coroutine commands --
+-- These have to be called from a coroutine and suspend it until the reply was received in poll().
+-- poll() has to be called from a different coroutine or the main thread.
+-- If the command could not be sent, they return nil immediately. If the connection is lost, they return nil.
+-- Calling them from the main thread raises an error. On Lua 5.3+, calling them where the coroutine can not yield
+-- (e.g. from a metamethod or a callback of a C function) raises an error as well. Lua 5.1/5.2 can not detect the
+-- latter before the command is sent, so Lua itself raises "attempt to yield across a C-call boundary" instead.
+
+---Query the server for keys in data storage and wait for the reply.
+---@param keys string[] keys to query
+---@param extra {[string]: any}? Additional data to send in the command. Will be included in the returned command.
+---@return {[string]: any}? data key-value table for the requested keys
+---@return {[string]: any}? command the complete Retrieved command
+function APClient:await_get(keys, extra) end
+
+---Set a value in data storage and wait for the reply.
+---@param key string key to change the value for
+---@param default any default value if not set yet
+---@param operations {[string]: any}[] operations to change value
+---@param extra {[string]: any}? Additional data to send in the command. Will be included in the returned command.
+---@return {[string]: any}? command the SetReply command
+function APClient:await_set(key, default, operations, extra) end
+
+---Query the server for location details and wait for the reply.
+---The reply is matched by the exact set of requested location IDs. An empty list returns an empty table immediately.
+---@param locations integer[] location IDs to be scouted
+---@param create_as_hint CreateAsHint?
+---@return NetworkItem[]? items
+function APClient:await_scout(locations, create_as_hint) end
+
 -- Helper types and enums --
 
 ---@enum clientstatus
@@ -378,6 +561,49 @@ APClient.EMPTY_ARRAY = {}
 ---@field alias string
 ---@field name string
 
+---@class HandlerStats
+---@field calls integer
+---@field errors integer
+---@field over_budget integer calls that took longer than the budget set with `set_handler_budget`
+---@field marshal_time number total seconds spent converting arguments to Lua
+---@field lua_time number total seconds spent in the handler, not measured with yieldable handlers
+---@field min_time number seconds
+---@field avg_time number seconds
+---@field p99_time number seconds, upper bound from the histogram
+---@field max_time number seconds
+---@field histogram integer[] number of calls by time, entry i counts calls below 2^(i-1) microseconds, last one the rest
+
+---@class Metrics
+---@field polls integer number of calls to poll
+---@field poll_time number total seconds spent in poll, including handlers
+---@field max_poll_time number longest poll in seconds
+---@field native_time number seconds spent in the native client: socket, decompression, parsing and validation
+---@field event_time number seconds spent processing received events, including handlers
+---@field events table<string, integer> number of received events by name, e.g. `items_received`
+---@field queues table<string, integer> current number of queued events, pending requests, pending scouts and journaled checks
+
+---@class MemoryUsage
+---@field data_package integer
+---@field item_log integer received items kept for save_state, see set_item_log_enabled
+---@field location_sets integer checked and missing locations
+---@field storage integer cached data storage values and keys
+---@field pending integer pending requests, scouts, queued events, journaled checks and sent bounces
+---@field diagnostics integer handler stats and trace buffer
+---@field total integer
+
+---@class ReconnectPolicy
+---@field min_delay number? seconds before the first attempt, default 1
+---@field max_delay number? maximum seconds between attempts, default 30
+---@field jitter number? fraction of the delay that is randomly added or removed, 0 to 1, default 0.1
+---@field max_attempts integer? attempts before giving up, default 0 for unlimited
+
+---@class ConnectionStats
+---@field attempts integer number of times the client started connecting
+---@field connects integer number of times RoomInfo was received
+---@field reconnects integer connects after the first one
+---@field last_connect_time number time of the last successful connect
+---@field avg_connect_time number average time of successful connects
+
 ---@class NetworkItem
 ---@field item integer item id of the item
 ---@field location integer location id of the item inside the world
@@ -386,6 +612,51 @@ APClient.EMPTY_ARRAY = {}
 ---@field index integer? for ReceivedItems this can be used to detect new/old items
 
 
+-- Client groups --
+
+---Group of clients that are polled together. Each client still has its own connection.
+---The group keeps its clients alive until they are removed or the group is collected.
+---@class APClientGroup
+APClientGroup = {}
+
+---Add a client to the group.
+---@param client APClient
+---@return boolean added false if the client already is in the group
+function APClientGroup:add(client) end
+
+---Remove a client from the group.
+---@param client APClient
+---@return boolean removed false if the client is not in the group
+function APClientGroup:remove(client) end
+
+---@return integer count number of clients in the group
+function APClientGroup:size() end
+
+---Poll all clients in the group, see `APClient:poll()`.
+---All clients are polled even if one of them raises, the errors are combined and raised afterwards.
+---Handlers can not yield when being polled through a group.
+---@return boolean
+function APClientGroup:poll() end
+
+---Spread the network part of `poll()` over native worker threads, for groups with many clients.
+---Receiving and parsing runs in parallel, handlers are still called from the thread calling `poll()`.
+---@param threads integer number of extra threads, 0 to disable
+function APClientGroup:set_worker_threads(threads) end
+
+
+-- Connection race --
+
+---@class APClientRace
+APClientRace = {}
+
+---Poll the connection attempts. The losing attempt is dropped once a winner is known.
+---The winner already received RoomInfo. Its socket_connected and room_info handlers that are set before its first
+---`poll()` are called from that poll, so `ConnectSlot` can be sent from the room_info handler as usual.
+---Raises an error with the reason of each attempt once all of them failed.
+---@return APClient|nil client the winning client or nil if still connecting
+function APClientRace:poll() end
+
+
 -- Dirty hack to make __call work as constructor --
 
 APClient = APClient.__call
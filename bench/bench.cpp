@@ -0,0 +1,382 @@
+// In-process benchmark for the Lua binding hot paths.
+// This includes the binding source, creates clients in an embedded lua_State and feeds synthetic server events
+// directly into the internal handlers, so no socket or server is involved.
+// The end-to-end part connects a client to the mock server running on a thread instead.
+// Build with ./build_bench.sh, see bench/README.md.
+
+// mock server first, the binding turns -Wconversion into an error for everything after it
+#include "mock_server.hpp"
+#include "../src/lua-apclientpp.cpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdlib>
+#include <new>
+
+
+// allocation counting
+
+static std::atomic<uint64_t> cxx_allocs{0};
+static uint64_t lua_allocs = 0;
+
+void* operator new(size_t size)
+{
+    cxx_allocs++;
+    void* p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+static void* lua_alloc(void*, void* ptr, size_t osize, size_t nsize)
+{
+    (void)osize;
+    if (nsize == 0) {
+        free(ptr);
+        return nullptr;
+    }
+    if (!ptr || nsize > osize)
+        lua_allocs++;
+    return realloc(ptr, nsize);
+}
+
+
+// benchmark state
+
+static const char* BENCH_HANDLERS = R"(
+local ap = ...
+local sum = 0
+ap:set_items_received_handler(function(items)
+    for _, item in ipairs(items) do
+        sum = sum + item.item
+    end
+end)
+ap:set_location_checked_handler(function(locations)
+    sum = sum + #locations
+end)
+ap:set_data_package_changed_handler(function(data_package)
+    for _, game in pairs(data_package.games) do
+        sum = sum + #game.checksum
+    end
+end)
+ap:set_print_json_handler(function(data, cmd)
+    sum = sum + #data
+end)
+)";
+
+class Bench
+{
+public:
+    Bench()
+    {
+        L = lua_newstate(lua_alloc, nullptr);
+        if (!L) {
+            // LuaJIT on 64bit does not support custom allocators
+            L = luaL_newstate();
+            count_lua_allocs = false;
+        }
+        luaL_openlibs(L);
+    }
+
+    ~Bench()
+    {
+        lua_close(L);
+    }
+
+    /// Create a new client at stack index 1, which is where the binding expects self when handling events
+    LuaAPClient* new_client()
+    {
+        lua_settop(L, 0);
+        luaopen_apclientpp(L);
+        lua_getfield(L, -1, "new");
+        lua_remove(L, -2);
+        lua_pushstring(L, "bench");
+        lua_pushstring(L, "Bench");
+        lua_pushstring(L, "ws://127.0.0.1:1"); // never polled, so never connects
+        lua_call(L, 3, 1);
+        if (luaL_loadstring(L, BENCH_HANDLERS) != 0)
+            fail(lua_tostring(L, -1));
+        lua_pushvalue(L, 1);
+        lua_call(L, 1, 0);
+        return LuaAPClient::luaL_checkthis(L, 1);
+    }
+
+    /// Run setup and f repeat times. f runs ops operations and the fastest run is reported.
+    template <class S, class F>
+    void run(const char* name, size_t ops, S setup, F f)
+    {
+        double best_ns = 0;
+        uint64_t best_cxx = 0;
+        uint64_t best_lua = 0;
+        for (int i = 0; i < repeat; i++) {
+            auto state = setup();
+            lua_gc(L, LUA_GCCOLLECT, 0);
+            const uint64_t cxx_start = cxx_allocs;
+            const uint64_t lua_start = lua_allocs;
+            const auto start = std::chrono::steady_clock::now();
+            f(state);
+            const auto end = std::chrono::steady_clock::now();
+            const double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+            if (i == 0 || ns < best_ns) {
+                best_ns = ns;
+                best_cxx = cxx_allocs - cxx_start;
+                best_lua = lua_allocs - lua_start;
+            }
+        }
+        if (count_lua_allocs) {
+            printf("%-24s %10zu %14.1f %12.2f %12.2f\n", name, ops, best_ns / (double)ops,
+                   (double)best_cxx / (double)ops, (double)best_lua / (double)ops);
+        } else {
+            printf("%-24s %10zu %14.1f %12.2f %12s\n", name, ops, best_ns / (double)ops,
+                   (double)best_cxx / (double)ops, "n/a");
+        }
+        fflush(stdout);
+    }
+
+    [[noreturn]] static void fail(const char* msg)
+    {
+        fprintf(stderr, "%s\n", msg ? msg : "<null>");
+        exit(1);
+    }
+
+    lua_State* L;
+    bool count_lua_allocs = true;
+    int repeat = 5;
+};
+
+
+// end-to-end
+
+static const char* BENCH_E2E = R"(
+local ap, item_count = ...
+stats = {items = 0, latencies = {}}
+ap:set_room_info_handler(function()
+    ap:ConnectSlot("Player1", "", 7, {"Bench"}, {0, 6, 3})
+end)
+ap:set_slot_connected_handler(function()
+    stats.connected = bench_now()
+end)
+ap:set_items_received_handler(function(items)
+    stats.items = stats.items + #items
+    if stats.items >= item_count and not stats.done then
+        stats.done = bench_now()
+    end
+end)
+ap:set_bounced_handler(function(cmd)
+    table.insert(stats.latencies, bench_now() - cmd.data.server_time)
+end)
+)";
+
+static double unix_time()
+{
+    using namespace std::chrono;
+    return (double)duration_cast<microseconds>(system_clock::now().time_since_epoch()).count() / 1e6;
+}
+
+static int bench_now(lua_State *L)
+{
+    lua_pushnumber(L, unix_time());
+    return 1;
+}
+
+/// Receive item_count items as fast as the mock server can send them, while it also sends one Bounced per ms.
+/// Reports time per item from slot connect and the latency of the Bounced packets.
+static void run_end_to_end(Bench& bench, size_t item_count, size_t bounce_count)
+{
+    json item_packet = {{"cmd", "ReceivedItems"}, {"items", json::array()}};
+    item_packet["items"].push_back({{"item", 1}, {"location", 1}, {"player", 1}, {"flags", 0}});
+    json items_step = {{"count", item_count}, {"packet", item_packet}};
+    json bounce_step = {{"interval", 0.001}, {"count", bounce_count},
+                        {"packet", {{"cmd", "Bounced"}, {"data", json::object()}}}};
+    json scenario = {{"start_items", 0}, {"steps", json::array({items_step, bounce_step})}};
+
+    MockServer server(scenario);
+    const uint16_t port = server.listen(0);
+    server.start();
+
+    lua_State* L = bench.L;
+    lua_settop(L, 0);
+    lua_register(L, "bench_now", bench_now);
+    luaopen_apclientpp(L);
+    lua_getfield(L, -1, "new");
+    lua_remove(L, -2);
+    lua_pushstring(L, "bench");
+    lua_pushstring(L, "Game");
+    lua_pushstring(L, ("ws://127.0.0.1:" + std::to_string(port)).c_str());
+    lua_call(L, 3, 1);
+    if (luaL_loadstring(L, BENCH_E2E) != 0)
+        Bench::fail(lua_tostring(L, -1));
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, (lua_Integer)item_count);
+    lua_call(L, 2, 0);
+
+    bool done = false;
+    size_t latency_count = 0;
+    const auto timeout = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+    while (!done || latency_count < bounce_count) {
+        if (std::chrono::steady_clock::now() > timeout)
+            Bench::fail("end-to-end timed out");
+        lua_getfield(L, 1, "poll");
+        lua_pushvalue(L, 1);
+        if (lua_pcall(L, 1, 0, 0) != 0)
+            Bench::fail(lua_tostring(L, -1));
+        lua_getglobal(L, "stats");
+        lua_getfield(L, -1, "done");
+        done = !lua_isnil(L, -1);
+        lua_getfield(L, -2, "latencies");
+        latency_count = (size_t)luaL_len(L, -1);
+        lua_pop(L, 3);
+    }
+
+    lua_getglobal(L, "stats");
+    lua_getfield(L, -1, "connected");
+    const double connected = lua_tonumber(L, -1);
+    lua_getfield(L, -2, "done");
+    const double finished = lua_tonumber(L, -1);
+    lua_getfield(L, -3, "latencies");
+    std::vector<double> latencies;
+    for (lua_Integer i = 1; i <= (lua_Integer)latency_count; i++) {
+        lua_rawgeti(L, -1, (int)i);
+        latencies.push_back(lua_tonumber(L, -1) * 1000);
+        lua_pop(L, 1);
+    }
+    lua_settop(L, 0);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    server.stop();
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+        return latencies[std::min(latencies.size() - 1, (size_t)(p * (double)latencies.size()))];
+    };
+    printf("\nend-to-end via in-process mock server\n");
+    printf("%-24s %10zu %14.1f\n", "items_received_e2e", item_count,
+           (finished - connected) * 1e9 / (double)item_count);
+    printf("%-24s %10zu %10.3f ms p50 %10.3f ms p99 %10.3f ms max\n", "bounced_latency_e2e", latencies.size(),
+           percentile(0.5), percentile(0.99), latencies.back());
+    fflush(stdout);
+}
+
+
+// workloads
+
+static std::list<APClient::NetworkItem> make_items(size_t count)
+{
+    std::list<APClient::NetworkItem> items;
+    for (size_t i = 0; i < count; i++) {
+        APClient::NetworkItem item;
+        item.item = (int64_t)(1000 + i % 500);
+        item.location = (int64_t)(2000 + i);
+        item.player = (int)(1 + i % 16);
+        item.flags = (unsigned)(i % 8);
+        item.index = (int)i;
+        items.push_back(item);
+    }
+    return items;
+}
+
+/// Build a data package of about size bytes when dumped, split into games of about 500 kB
+static json make_data_package(size_t size)
+{
+    json games = json::object();
+    size_t total = 0;
+    for (int g = 0; total < size; g++) {
+        json game = {
+            {"item_name_to_id", json::object()},
+            {"location_name_to_id", json::object()},
+            {"checksum", "0123456789abcdef0123456789abcdef0123456" + std::to_string(g)},
+        };
+        size_t game_size = 0;
+        for (int64_t i = 0; game_size < 500000 && total + game_size < size; i++) {
+            std::string name = "Game " + std::to_string(g) + " Entry Name Number " + std::to_string(i);
+            game["item_name_to_id"]["Item " + name] = 100000 * g + i;
+            game["location_name_to_id"]["Location " + name] = 100000 * g + i;
+            game_size += 2 * (name.size() + 20);
+        }
+        total += game_size;
+        games["Game " + std::to_string(g)] = std::move(game);
+    }
+    return {{"games", games}};
+}
+
+static json make_print_json(int i)
+{
+    return {
+        {"cmd", "PrintJSON"},
+        {"type", "ItemSend"},
+        {"receiving", 2},
+        {"item", {{"item", 1000 + i}, {"location", 2000 + i}, {"player", 1}, {"flags", 1}}},
+        {"data", {
+            {{"type", "player_id"}, {"text", "1"}},
+            {{"text", " sent "}},
+            {{"type", "item_id"}, {"text", std::to_string(1000 + i)}, {"player", 2}, {"flags", 1}},
+            {{"text", " to "}},
+            {{"type", "player_id"}, {"text", "2"}},
+            {{"text", " ("}},
+            {{"type", "location_id"}, {"text", std::to_string(2000 + i)}, {"player", 1}},
+            {{"text", ")"}},
+        }},
+    };
+}
+
+int main(int argc, char** argv)
+{
+    Bench bench;
+    if (argc > 1)
+        bench.repeat = std::max(1, atoi(argv[1]));
+
+    printf("%s, best of %d\n", LUA_RELEASE, bench.repeat);
+    printf("%-24s %10s %14s %12s %12s\n", "scenario", "ops", "ns/op", "allocs/op", "lua allocs/op");
+
+    for (size_t count: {(size_t)10000, (size_t)100000}) {
+        const auto items = make_items(count);
+        const std::string name = "items_received_" + std::to_string(count / 1000) + "k";
+        bench.run(name.c_str(), count, [&]() {
+            return bench.new_client();
+        }, [&](LuaAPClient* client) {
+            client->on_items_received(items);
+        });
+    }
+
+    bench.run("location_checked_20k", 20000, [&]() {
+        return bench.new_client();
+    }, [&](LuaAPClient* client) {
+        for (int64_t i = 0; i < 20000; i++)
+            client->on_location_checked({2000 + i});
+    });
+
+    {
+        const json data_package = make_data_package(5000000);
+        bench.run("data_package_5mb", 1, [&]() {
+            return bench.new_client();
+        }, [&](LuaAPClient* client) {
+            client->on_data_package_changed(data_package);
+        });
+    }
+
+    {
+        std::vector<json> messages;
+        for (int i = 0; i < 1000; i++)
+            messages.push_back(make_print_json(i));
+        bench.run("print_json_1k", messages.size(), [&]() {
+            return bench.new_client();
+        }, [&](LuaAPClient* client) {
+            for (const auto& message: messages)
+                client->on_print_json(message);
+        });
+    }
+
+    run_end_to_end(bench, 10000, 1000);
+
+    lua_settop(bench.L, 0);
+    return 0;
+}
@@ -0,0 +1,35 @@
+// Stand-alone mock Archipelago server, see mock_server.hpp for the scenario format.
+// Usage: mock-server [port [scenario.json]]
+
+#include "mock_server.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+
+
+int main(int argc, char** argv)
+{
+    uint16_t port = argc > 1 ? (uint16_t)atoi(argv[1]) : 38281;
+    MockServer::json scenario = MockServer::json::object();
+    if (argc > 2) {
+        std::ifstream f(argv[2]);
+        scenario = MockServer::json::parse(f, nullptr, false);
+        if (!scenario.is_object()) {
+            fprintf(stderr, "Invalid scenario: %s\n", argv[2]);
+            return 1;
+        }
+    }
+
+    try {
+        MockServer server(scenario);
+        port = server.listen(port);
+        printf("Listening on ws://127.0.0.1:%u\n", (unsigned)port);
+        fflush(stdout);
+        server.run();
+    } catch (const std::exception& ex) {
+        fprintf(stderr, "%s\n", ex.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,306 @@
+// Minimal Archipelago server for load and latency testing of clients.
+// It accepts any slot name, answers the commands the client uses and plays back a scenario of packets at fixed
+// rates once a slot is connected. It can run in-process on its own thread or as the mock-server executable.
+
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include <websocketpp/config/asio_no_tls.hpp>
+#include <websocketpp/server.hpp>
+
+
+/// Scenario format (json), all fields are optional:
+/// {
+///   "game": "Game",
+///   "start_items": 10,           // number of items in the history before connecting
+///   "data_package_size": 0,      // approximate size in bytes of the data package for the game, 0 for none
+///   "steps": [
+///     {
+///       "after": 0.5,            // seconds after slot connect
+///       "interval": 0.001,       // seconds between packets, may be below 1ms
+///       "count": 1000,
+///       "packet": {"cmd": "PrintJSON", "data": [{"text": "hi"}]}
+///     }
+///   ]
+/// }
+/// ReceivedItems packets get their index set and their items appended to the history of the connection, so Sync
+/// works. Every connection starts with its own copy of the start items.
+/// Bounced packets get data.server_time set to the unix time in seconds, so clients can measure latency.
+class MockServer
+{
+public:
+    typedef nlohmann::json json;
+    typedef websocketpp::server<websocketpp::config::asio> Server;
+    typedef websocketpp::connection_hdl Handle;
+
+    MockServer(const json& scenario = json::object())
+        : scenario(scenario)
+    {
+        game = scenario.value("game", "Game");
+        const size_t start_count = scenario.value("start_items", (size_t)10);
+        for (size_t i = 0; i < start_count; i++)
+            start_items.push_back({{"item", 1 + (int64_t)i}, {"location", 1 + (int64_t)i}, {"player", 1}, {"flags", 0}});
+        data_package_size = scenario.value("data_package_size", (size_t)0);
+
+        server.clear_access_channels(websocketpp::log::alevel::all);
+        server.clear_error_channels(websocketpp::log::elevel::all);
+        server.init_asio();
+        server.set_reuse_addr(true);
+        server.set_open_handler([this](Handle hdl) { on_open(hdl); });
+        server.set_close_handler([this](Handle hdl) { on_close(hdl); });
+        server.set_message_handler([this](Handle hdl, Server::message_ptr msg) { on_message(hdl, msg); });
+    }
+
+    ~MockServer()
+    {
+        stop();
+    }
+
+    /// Start listening on 127.0.0.1. Returns the port, which is useful when passing 0.
+    uint16_t listen(uint16_t port = 0)
+    {
+        server.listen(websocketpp::lib::asio::ip::tcp::endpoint(
+                websocketpp::lib::asio::ip::address_v4::loopback(), port));
+        server.start_accept();
+        websocketpp::lib::asio::error_code ec;
+        return server.get_local_endpoint(ec).port();
+    }
+
+    /// Run until stopped, blocking the calling thread
+    void run()
+    {
+        server.run();
+    }
+
+    /// Run on a background thread
+    void start()
+    {
+        thread = std::thread([this]() { run(); });
+    }
+
+    void stop()
+    {
+        if (!server.stopped()) {
+            websocketpp::lib::error_code ec;
+            server.stop_listening(ec);
+            server.stop();
+        }
+        if (thread.joinable())
+            thread.join();
+    }
+
+private:
+    struct Connection {
+        bool authenticated = false;
+        json items; // received items history
+    };
+
+    void send(Handle hdl, const json& packet)
+    {
+        websocketpp::lib::error_code ec;
+        server.send(hdl, json::array({packet}).dump(), websocketpp::frame::opcode::text, ec);
+    }
+
+    static double unix_time()
+    {
+        using namespace std::chrono;
+        return (double)duration_cast<microseconds>(system_clock::now().time_since_epoch()).count() / 1e6;
+    }
+
+    void on_open(Handle hdl)
+    {
+        connections[hdl].items = start_items;
+        json checksums = json::object();
+        if (data_package_size)
+            checksums[game] = "mock" + std::to_string(data_package_size);
+        send(hdl, {
+            {"cmd", "RoomInfo"},
+            {"seed_name", "mock"},
+            {"time", unix_time()},
+            {"version", {{"major", 0}, {"minor", 6}, {"build", 3}, {"class", "Version"}}},
+            {"generator_version", {{"major", 0}, {"minor", 6}, {"build", 3}, {"class", "Version"}}},
+            {"tags", json::array()},
+            {"password", false},
+            {"hint_cost", 10},
+            {"location_check_points", 1},
+            {"games", {game}},
+            {"datapackage_checksums", checksums},
+            {"permissions", {{"release", 0}, {"collect", 0}, {"remaining", 0}}},
+        });
+    }
+
+    void on_close(Handle hdl)
+    {
+        // pending steps stop when they don't find the connection anymore
+        connections.erase(hdl);
+    }
+
+    void on_message(Handle hdl, Server::message_ptr msg)
+    {
+        const auto conn_it = connections.find(hdl);
+        if (conn_it == connections.end())
+            return;
+        Connection& conn = conn_it->second;
+        const json packets = json::parse(msg->get_payload(), nullptr, false);
+        if (!packets.is_array())
+            return;
+
+        for (const auto& args: packets) {
+            const std::string cmd = args.value("cmd", "");
+            if (cmd == "GetDataPackage") {
+                send(hdl, {{"cmd", "DataPackage"}, {"data", {{"games", {{game, make_game()}}}}}});
+            } else if (cmd == "Connect") {
+                conn.authenticated = true;
+                send(hdl, {
+                    {"cmd", "Connected"},
+                    {"team", 0},
+                    {"slot", 1},
+                    {"players", {{{"team", 0}, {"slot", 1}, {"alias", "Player1"}, {"name", "Player1"}}}},
+                    {"missing_locations", json::array()},
+                    {"checked_locations", json::array()},
+                    {"slot_data", json::object()},
+                    {"slot_info", {{"1", {{"name", "Player1"}, {"game", game}, {"type", 1},
+                                          {"group_members", json::array()}}}}},
+                    {"hint_points", 0},
+                });
+                send(hdl, {{"cmd", "ReceivedItems"}, {"index", 0}, {"items", conn.items}});
+                start_scenario(hdl);
+            } else if (!conn.authenticated) {
+                continue;
+            } else if (cmd == "Sync") {
+                send(hdl, {{"cmd", "ReceivedItems"}, {"index", 0}, {"items", conn.items}});
+            } else if (cmd == "LocationChecks") {
+                send(hdl, {{"cmd", "RoomUpdate"}, {"checked_locations", args.value("locations", json::array())}});
+            } else if (cmd == "LocationScouts") {
+                json locations = json::array();
+                for (const auto& location: args.value("locations", json::array()))
+                    locations.push_back({{"item", location}, {"location", location}, {"player", 1}, {"flags", 0}});
+                send(hdl, {{"cmd", "LocationInfo"}, {"locations", locations}});
+            } else if (cmd == "Bounce") {
+                json bounced = args;
+                bounced["cmd"] = "Bounced";
+                for (const auto& pair: connections)
+                    if (pair.second.authenticated)
+                        send(pair.first, bounced);
+            } else if (cmd == "Say") {
+                send(hdl, {{"cmd", "PrintJSON"}, {"type", "Chat"}, {"team", 0}, {"slot", 1},
+                           {"message", args.value("text", "")},
+                           {"data", {{{"text", "Player1: " + args.value("text", "")}}}}});
+            } else if (cmd == "Get") {
+                json reply = args;
+                reply["cmd"] = "Retrieved";
+                reply["keys"] = json::object();
+                for (const auto& key: args.value("keys", json::array())) {
+                    if (!key.is_string())
+                        continue;
+                    const auto it = storage.find(key.get<std::string>());
+                    reply["keys"][key.get<std::string>()] = it == storage.end() ? json() : it->second;
+                }
+                send(hdl, reply);
+            } else if (cmd == "Set") {
+                const std::string key = args.value("key", "");
+                json reply = args;
+                reply["cmd"] = "SetReply";
+                const auto it = storage.find(key);
+                json value = it == storage.end() ? args.value("default", json()) : it->second;
+                reply["original_value"] = value;
+                for (const auto& op: args.value("operations", json::array())) {
+                    if (op.value("operation", "") == "replace")
+                        value = op.value("value", json());
+                }
+                reply["value"] = storage[key] = value;
+                reply["slot"] = 1;
+                if (args.value("want_reply", false))
+                    send(hdl, reply);
+            }
+        }
+    }
+
+    json make_game() const
+    {
+        json game_data = {
+            {"item_name_to_id", json::object()},
+            {"location_name_to_id", json::object()},
+            {"checksum", "mock" + std::to_string(data_package_size)},
+        };
+        size_t size = 0;
+        for (int64_t i = 1; size < data_package_size; i++) {
+            std::string name = "Mock Entry Name Number " + std::to_string(i);
+            game_data["item_name_to_id"]["Item " + name] = i;
+            game_data["location_name_to_id"]["Location " + name] = i;
+            size += 2 * (name.size() + 20);
+        }
+        return game_data;
+    }
+
+    void start_scenario(Handle hdl)
+    {
+        const auto steps_it = scenario.find("steps");
+        if (steps_it == scenario.end() || !steps_it->is_array())
+            return;
+        const auto start = std::chrono::steady_clock::now();
+        for (const auto& step: *steps_it) {
+            const auto after = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(step.value("after", 0.0)));
+            run_step(hdl, step, start + after, 0);
+        }
+    }
+
+    /// Send all packets of step that are due and reschedule until count packets were sent
+    void run_step(Handle hdl, const json& step, std::chrono::steady_clock::time_point start, size_t sent)
+    {
+        const size_t count = step.value("count", (size_t)1);
+        const double interval = step.value("interval", 0.0);
+        const auto conn_it = connections.find(hdl);
+        if (conn_it == connections.end())
+            return;
+        const auto now = std::chrono::steady_clock::now();
+        if (now >= start) {
+            const double elapsed = std::chrono::duration<double>(now - start).count();
+            size_t due = interval > 0 ? (size_t)(elapsed / interval) + 1 : count;
+            if (due > count)
+                due = count;
+            for (; sent < due; sent++)
+                send(hdl, make_packet(conn_it->second, step.value("packet", json::object())));
+            if (sent >= count)
+                return;
+        }
+        long delay = now >= start ? 1 : (long)std::chrono::duration_cast<std::chrono::milliseconds>(start - now).count();
+        const json* step_ptr = &step; // scenario outlives the server
+        server.set_timer(delay, [this, hdl, step_ptr, start, sent](const websocketpp::lib::error_code& ec) {
+            if (!ec)
+                run_step(hdl, *step_ptr, start, sent);
+        });
+    }
+
+    json make_packet(Connection& conn, const json& packet)
+    {
+        json res = packet;
+        const std::string cmd = packet.value("cmd", "");
+        if (cmd == "ReceivedItems") {
+            res["index"] = conn.items.size();
+            for (const auto& item: packet.value("items", json::array()))
+                conn.items.push_back(item);
+        } else if (cmd == "Bounced") {
+            if (!res["data"].is_object())
+                res["data"] = json::object();
+            res["data"]["server_time"] = unix_time();
+        }
+        return res;
+    }
+
+    const json scenario;
+    std::string game;
+    size_t data_package_size = 0;
+    json start_items = json::array();
+    std::map<std::string, json> storage;
+    std::map<Handle, Connection, std::owner_less<Handle>> connections;
+    Server server;
+    std::thread thread;
+};
@@ -0,0 +1,26 @@
+#!/bin/sh
+# build helper for the benchmark on Linux and macOS
+# to specify a lua version, pass "luaXX" as first argument
+#
+# shellcheck disable=SC2181
+# SC2181: Using $? for readability.
+
+. ./build_common.sh
+. ./extra_pkgconf.sh
+
+LIBS="$LIBS -pthread -lssl -lcrypto -lz"
+
+CFLAGS="-O2 -DNDEBUG -DAP_NO_SCHEMA -std=$STD -Wall -Wextra -Werror -Wno-deprecated-declarations $EXTRA_CFLAGS $CFLAGS"
+
+OUT="bench-$LUA"
+
+# shellcheck disable=SC2086 # variables need to be expanded
+"$CXX" $CFLAGS $DEFINES $INCLUDE_DIRS -o "$OUT" bench/bench.cpp $DYNAMIC_LIBS $EXTRA_LIBS_STATIC $LIBS
+if [ $? -ne 0 ]; then
+    exit 1
+fi
+
+# stand-alone mock server, does not depend on Lua
+# shellcheck disable=SC2086 # variables need to be expanded
+"$CXX" $CFLAGS $DEFINES $INCLUDE_DIRS -o mock-server bench/mock_server.cpp $DYNAMIC_LIBS -pthread
+exit $?
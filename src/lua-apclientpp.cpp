@@ -31,6 +31,23 @@ extern "C" {
 #include <lauxlib.h>
 }
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <utility>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 #include <apclient.hpp>
 #include <luaglue/luacompat.h>
 #include <luaglue/luapp.h>
@@ -114,6 +131,14 @@ static void to_json(json& j, const APClient::NetworkItem& item) {
     };
 }
 
+static void from_json(const json& j, APClient::NetworkItem& item) {
+    j.at("item").get_to(item.item);
+    j.at("location").get_to(item.location);
+    j.at("player").get_to(item.player);
+    j.at("flags").get_to(item.flags);
+    item.index = j.value("index", -1);
+}
+
 static void from_json(const json& j, APClient::DataStorageOperation& op) {
     if (j.is_array() && j.size() == 2) {
         j[0].get_to(op.operation);
@@ -147,6 +172,12 @@ private:
     std::string message;
 };
 
+/// Key added to extra of internal Get commands, so the replies can be identified
+static const char STORAGE_SYNC_KEY[] = "_lua_apclientpp_sync";
+/// Key added to extra of Get and Set commands that have a callback, to route the reply
+static const char REQUEST_ID_KEY[] = "_lua_apclientpp_id";
+static const char BOUNCE_NONCE_KEY[] = "_lua_apclientpp_bounce";
+
 /// Helper function to get integer from Lua stack and check bounds to fit c int
 static int checkcint(lua_State *L, int arg)
 {
@@ -165,24 +196,273 @@ static int checkcint(lua_State *L, int arg)
     return static_cast<int>(val);
 }
 
+/// Default cert store for clients created without one, shared by all Lua states. Empty for the system store.
+static std::mutex default_cert_store_mutex;
+static std::string default_cert_store;
+
+static std::string get_default_cert_store()
+{
+    std::lock_guard<std::mutex> lock(default_cert_store_mutex);
+    return default_cert_store;
+}
+
+static void set_default_cert_store(const std::string& path)
+{
+    std::lock_guard<std::mutex> lock(default_cert_store_mutex);
+    default_cert_store = path;
+}
+
+/// Resume coroutine co with nargs arguments on its stack. nres is set to the number of values left on its stack.
+static int resume_thread(lua_State *co, lua_State *from, int nargs, int *nres)
+{
+#if LUA_VERSION_NUM >= 504
+    return lua_resume(co, from, nargs, nres);
+#elif LUA_VERSION_NUM >= 502
+    int status = lua_resume(co, from, nargs);
+    *nres = lua_gettop(co);
+    return status;
+#else
+    (void)from;
+    int status = lua_resume(co, nargs);
+    *nres = lua_gettop(co);
+    return status;
+#endif
+}
+
+// Estimates of heap memory held by containers, for get_memory_usage. These assume a red-black tree node header of
+// 4 pointers, a list node header of 2 pointers and strings up to 15 chars being stored inline.
+static constexpr size_t TREE_NODE_OVERHEAD = 4 * sizeof(void*);
+static constexpr size_t LIST_NODE_OVERHEAD = 2 * sizeof(void*);
+
+static size_t heap_size(const std::string& s)
+{
+    return s.capacity() > 15 ? s.capacity() + 1 : 0;
+}
+
+static size_t heap_size(const nlohmann::json& j)
+{
+    typedef nlohmann::json json;
+    switch (j.type()) {
+        case json::value_t::object: {
+            size_t res = sizeof(json::object_t);
+            for (const auto& pair: j.get_ref<const json::object_t&>())
+                res += TREE_NODE_OVERHEAD + sizeof(pair) + heap_size(pair.first) + heap_size(pair.second);
+            return res;
+        }
+        case json::value_t::array: {
+            const auto& arr = j.get_ref<const json::array_t&>();
+            size_t res = sizeof(json::array_t) + arr.capacity() * sizeof(json);
+            for (const auto& value: arr)
+                res += heap_size(value);
+            return res;
+        }
+        case json::value_t::string:
+            return sizeof(std::string) + heap_size(j.get_ref<const std::string&>());
+        default:
+            return 0;
+    }
+}
+
+template <class T>
+static size_t heap_size(const std::set<T>& set)
+{
+    return set.size() * (TREE_NODE_OVERHEAD + sizeof(T));
+}
+
+static const char STATE_MAGIC[] = "APCS";
+static const uint32_t STATE_VERSION = 1;
+static const char CAPTURE_MAGIC[] = "APCT";
+static const uint32_t CAPTURE_VERSION = 1;
+
+/// Little-endian encoding of client state snapshots, see LuaAPClient::save_state
+class StateWriter
+{
+public:
+    void u32(uint32_t v)
+    {
+        for (int i = 0; i < 4; i++)
+            data.push_back((char)((v >> (8 * i)) & 0xff));
+    }
+
+    void i32(int32_t v)
+    {
+        u32((uint32_t)v);
+    }
+
+    void i64(int64_t v)
+    {
+        uint64_t u = (uint64_t)v;
+        for (int i = 0; i < 8; i++)
+            data.push_back((char)((u >> (8 * i)) & 0xff));
+    }
+
+    void str(const std::string& s)
+    {
+        u32((uint32_t)s.size());
+        data += s;
+    }
+
+    std::string data;
+};
+
+class StateReader
+{
+public:
+    StateReader(const std::string& data)
+        : data(data)
+    {
+    }
+
+    uint32_t u32()
+    {
+        need(4);
+        uint32_t v = 0;
+        for (int i = 0; i < 4; i++)
+            v |= (uint32_t)(uint8_t)data[pos++] << (8 * i);
+        return v;
+    }
+
+    int32_t i32()
+    {
+        return (int32_t)u32();
+    }
+
+    int64_t i64()
+    {
+        need(8);
+        uint64_t v = 0;
+        for (int i = 0; i < 8; i++)
+            v |= (uint64_t)(uint8_t)data[pos++] << (8 * i);
+        return (int64_t)v;
+    }
+
+    std::string str()
+    {
+        size_t n = u32();
+        need(n);
+        std::string s = data.substr(pos, n);
+        pos += n;
+        return s;
+    }
+
+    bool done() const
+    {
+        return pos == data.size();
+    }
+
+private:
+    void need(size_t n) const
+    {
+        if (data.size() - pos < n)
+            throw std::runtime_error("Truncated state file");
+    }
+
+    const std::string& data;
+    size_t pos = 0;
+};
+
 // subclass for extra fields
 // NOTE: we still need some C functions for variable arguments
 // TODO: make lua glue support this use-case better
 class LuaAPClient : public APClient
 {
 public:
-    LuaAPClient(lua_State *L, const std::string& uuid, const std::string& game, const std::string& uri = DEFAULT_URI)
-        : APClient(uuid, game, uri), _L(L)
-    {
-        // TODO: cert Store
+    /// Callback or coroutine waiting for a reply
+    struct PendingRequest {
+        LuaRef ref;
+        bool is_thread;
+
+        PendingRequest(LuaRef ref = {}, bool is_thread = false)
+            : ref(ref), is_thread(is_thread)
+        {
+        }
+    };
+
+    /// Coroutine waiting for LocationInfo
+    struct PendingScout {
+        std::set<int64_t> locations;
+        LuaRef thread;
+    };
+
+    /// Connection timing, updated at the end of each poll
+    struct ConnectionStats {
+        uint64_t attempts = 0; // times the client started connecting
+        uint64_t connects = 0; // times the client reached ROOM_INFO
+        double last_connect_time = 0; // seconds from start of connecting to ROOM_INFO
+        double total_connect_time = 0;
+    };
+
+    /// Timing of one handler, collected while stats are enabled
+    struct HandlerStats {
+        static constexpr size_t BUCKETS = 24;
+        uint64_t calls = 0;
+        uint64_t errors = 0;
+        uint64_t over_budget = 0; // calls that took longer than the handler budget
+        std::chrono::nanoseconds marshal_time{0}; // converting arguments to Lua
+        std::chrono::nanoseconds lua_time{0}; // running the handler, not measured for deferred calls
+        std::chrono::nanoseconds min_time = std::chrono::nanoseconds::max();
+        std::chrono::nanoseconds max_time{0};
+        uint64_t histogram[BUCKETS] = {}; // by marshal + lua time, bucket i counts calls below 2^i us, last is the rest
+    };
+
+    struct CStringLess {
+        bool operator()(const char* a, const char* b) const
+        {
+            return strcmp(a, b) < 0;
+        }
+    };
+
+    /// Always-on counters, cheap enough to leave enabled
+    struct Metrics {
+        uint64_t polls = 0;
+        std::chrono::nanoseconds poll_time{0}; // total time in poll, including handlers
+        std::chrono::nanoseconds max_poll_time{0};
+        std::chrono::nanoseconds native_time{0}; // apclientpp's poll: socket, inflate, parsing and validation
+        std::chrono::nanoseconds event_time{0}; // processing received events, including handlers
+        std::map<const char*, uint64_t, CStringLess> events; // received events by name
+    };
+
+    /// Reconnect timing in seconds. Without a policy, reconnecting is left to apclientpp.
+    struct ReconnectPolicy {
+        bool enabled = false;
+        double min_delay = 1;
+        double max_delay = 30;
+        double jitter = 0.1; // random fraction of the delay added or removed
+        uint64_t max_attempts = 0; // 0 for unlimited
+    };
 
+    LuaAPClient(lua_State *L, const std::string& uuid, const std::string& game, const std::string& uri = DEFAULT_URI,
+                const std::string& certStore = "")
+        : APClient(uuid, game, uri, certStore), _L(L)
+    {
         // connect internal handlers
         APClient* parent = this;
         parent->set_slot_connected_handler([this](const json& slot_data) {
-            on_slot_connected(slot_data);
+            dispatch("slot_connected", &LuaAPClient::on_slot_connected, slot_data);
         });
         parent->set_location_checked_handler([this](const std::list<int64_t>& locations) {
-            on_location_checked(locations);
+            dispatch("location_checked", &LuaAPClient::on_location_checked, locations);
+        });
+        parent->set_bounced_handler([this](const json& bounce) {
+            dispatch("bounced", &LuaAPClient::on_bounced, bounce);
+        });
+        parent->set_retrieved_handler([this](const std::map<std::string, json>& data, const json& message) {
+            dispatch("retrieved", &LuaAPClient::on_retrieved, data, message);
+        });
+        parent->set_set_reply_handler([this](const json& message) {
+            dispatch("set_reply", &LuaAPClient::on_set_reply, message);
+        });
+        parent->set_socket_disconnected_handler([this]() {
+            dispatch("socket_disconnected", &LuaAPClient::on_socket_disconnected);
+        });
+        parent->set_location_info_handler([this](const std::list<NetworkItem>& items) {
+            dispatch("location_info", &LuaAPClient::on_location_info, items);
+        });
+        parent->set_data_package_changed_handler([this](const json& data_package) {
+            dispatch("data_package_changed", &LuaAPClient::on_data_package_changed, data_package);
+        });
+        parent->set_items_received_handler([this](const std::list<NetworkItem>& items) {
+            dispatch("items_received", &LuaAPClient::on_items_received, items);
         });
     }
 
@@ -201,48 +481,400 @@ public:
         unref(print_cb);
         unref(print_json_cb);
         unref(bounced_cb);
+        for (auto& pair: bounced_tag_cbs)
+            unref(pair.second);
         unref(retrieved_cb);
         unref(set_reply_cb);
+        unref(handler_budget_cb);
+        for (auto& pair: pending_requests)
+            unref(pair.second.ref);
+        for (auto& scout: pending_scouts)
+            unref(scout.thread);
+#if LUA_VERSION_NUM >= 502
+        for (auto& call: deferred_calls)
+            unref(call.call);
+#endif
         unref(checked_locations);
         unref(missing_locations);
+        close_check_journal();
+        set_capture("");
     }
 
     // internal handlers
 
     void on_slot_connected(const json& slot_data)
     {
+        if (replaying) {
+            if (slot_connected_cb.valid()) {
+                call_handler("slot_connected", slot_connected_cb, [&]() {
+                    json_to_lua(_L, slot_data);
+                    return 1;
+                });
+            }
+            return;
+        }
+
+        // a restored or previous item log only applies to the same slot in the same room
+        if (item_log_seed != get_seed() || item_log_team != get_team_number()
+                || item_log_slot != get_player_number()) {
+            item_log.clear();
+            skip_logged_items = false;
+            item_log_seed = get_seed();
+            item_log_team = get_team_number();
+            item_log_slot = get_player_number();
+        }
+        received_count = 0;
+        // mirrored data storage values and subscriptions only apply to the same slot in the same room
+        if (storage_seed != get_seed() || storage_team != get_team_number()
+                || storage_slot != get_player_number()) {
+            storage.clear();
+            if (!storage_seed.empty()) // keep keys subscribed before the first connect
+                storage_notify_keys.clear();
+            storage_seed = get_seed();
+            storage_team = get_team_number();
+            storage_slot = get_player_number();
+        }
+        // checks journaled for another slot or room must not be sent to this one
+        if (!check_journal.empty() && !journal_seed.empty() && (journal_seed != get_seed()
+                || journal_team != get_team_number() || journal_slot != get_player_number())) {
+            print_error("Discarding " + std::to_string(check_journal.size())
+                        + " journaled checks made for a different slot");
+            check_journal.clear();
+            truncate_check_journal();
+        }
+        // send checks made while disconnected in one packet
+        flush_check_journal();
+        journal_seed = get_seed();
+        journal_team = get_team_number();
+        journal_slot = get_player_number();
+        known_checked = get_checked_locations();
+
         // sync location tables
         assign_set("checked_locations", get_checked_locations(), 1);
         assign_set("missing_locations", get_missing_locations(), 1);
 
+        // re-subscribe and reconcile data storage mirror
+        storage_resync();
+
         if (slot_connected_cb.valid()) {
-            lua_pushcfunction(_L, error_handler);
-            lua_rawgeti(_L, LUA_REGISTRYINDEX, slot_connected_cb.ref);
-            json_to_lua(_L, slot_data);
-            if (lua_pcall(_L, 1, 0, -3)) {
-                cb_error("slot_connected");
-            }
-            lua_pop(_L, 1);
+            call_handler("slot_connected", slot_connected_cb, [&]() {
+                json_to_lua(_L, slot_data);
+                return 1;
+            });
         }
     }
 
     void on_location_checked(const std::list<int64_t>& locations)
     {
-        // sync location tables
-        add_list("checked_locations", locations, 1);
-        assign_set("missing_locations", get_missing_locations(), 1);
+        if (!replaying) {
+            known_checked.insert(locations.begin(), locations.end());
+
+            // sync location tables
+            add_list("checked_locations", locations, 1);
+            assign_set("missing_locations", get_missing_locations(), 1);
+        }
 
         if (location_checked_cb.valid()) {
-            lua_pushcfunction(_L, error_handler);
-            lua_rawgeti(_L, LUA_REGISTRYINDEX, location_checked_cb.ref);
-            {
+            call_handler("location_checked", location_checked_cb, [&]() {
                 json j = locations;
                 json_to_lua(_L, j);
+                return 1;
+            });
+        }
+    }
+
+    void on_bounced(const json& received)
+    {
+        // drop the echo of our own Bounce by its nonce and hide the nonce from handlers
+        json stripped;
+        const auto nonce_data_it = received.find("data");
+        const bool has_nonce = nonce_data_it != received.end() && nonce_data_it->is_object()
+                && nonce_data_it->find(BOUNCE_NONCE_KEY) != nonce_data_it->end();
+        if (has_nonce) {
+            if (!replaying && is_bounce_echo(nonce_data_it->at(BOUNCE_NONCE_KEY)))
+                return;
+            stripped = received;
+            stripped["data"].erase(BOUNCE_NONCE_KEY);
+        }
+        const json& bounce = has_nonce ? stripped : received;
+
+        // route by tag, only converting data for the matched handlers
+        std::vector<std::string> matched;
+        if (!bounced_tag_cbs.empty()) {
+            const auto tags_it = bounce.find("tags");
+            if (tags_it != bounce.end() && tags_it->is_array()) {
+                for (const auto& tag: *tags_it) {
+                    if (!tag.is_string())
+                        continue;
+                    const auto& s = tag.get_ref<const std::string&>();
+                    if (bounced_tag_cbs.find(s) != bounced_tag_cbs.end()
+                            && std::find(matched.begin(), matched.end(), s) == matched.end())
+                        matched.push_back(s);
+                }
+            }
+        }
+
+        if (!matched.empty()) {
+            const auto data_it = bounce.find("data");
+            for (const auto& tag: matched) {
+                // handlers may change the routing table, so look up again
+                const auto cb_it = bounced_tag_cbs.find(tag);
+                if (cb_it == bounced_tag_cbs.end() || !cb_it->second.valid())
+                    continue;
+                call_handler("bounced_tag", cb_it->second, [&]() {
+                    if (data_it != bounce.end())
+                        json_to_lua(_L, *data_it);
+                    else
+                        lua_pushnil(_L);
+                    return 1;
+                }, "_handler", &tag);
+            }
+            return;
+        }
+
+        if (bounced_cb.valid()) {
+            call_handler("bounced", bounced_cb, [&]() {
+                json_to_lua(_L, bounce);
+                return 1;
+            });
+        }
+    }
+
+    void on_socket_disconnected()
+    {
+        if (!replaying) {
+            // the next connect may start in the same poll
+            socket_dropped = true;
+
+            // replies to pending requests will never arrive, waiting coroutines get nil
+            clear_pending_requests();
+        }
+
+        if (socket_disconnected_cb.valid()) {
+            call_handler("socket_disconnected", socket_disconnected_cb, []() {
+                return 0;
+            });
+        }
+    }
+
+    void on_retrieved(const std::map<std::string, json>& data, const json& message)
+    {
+        if (!replaying) {
+            for (const auto& pair: data)
+                storage_update(pair.first, pair.second);
+        }
+
+        // replies to our own reconcile are not forwarded
+        if (message.find(STORAGE_SYNC_KEY) != message.end())
+            return;
+
+        // the command already has data as json object, avoid building a copy if possible
+        json copy;
+        const auto data_it = message.find("keys");
+        const json& j = (data_it != message.end() && data_it->is_object()) ? *data_it : (copy = data);
+
+        // replayed replies are not routed to requests of this session
+        PendingRequest req = replaying ? PendingRequest() : take_pending_request(message);
+        if (req.is_thread) {
+            resume_waiting("await_get", req.ref, [&](lua_State *co) {
+                json_to_lua(co, j);
+                push_reply(co, message);
+                return 2;
+            });
+        } else if (req.ref.valid()) {
+            call_handler("Get", req.ref, [&]() {
+                json_to_lua(_L, j);
+                push_reply(_L, message);
+                return 2;
+            }, " callback");
+            unref(req.ref);
+        } else if (retrieved_cb.valid()) {
+            call_handler("retrieved", retrieved_cb, [&]() {
+                std::list<std::string> keys;
+                for (const auto& pair: data)
+                    keys.push_back(pair.first);
+                json_to_lua(_L, j);
+                json_to_lua(_L, keys);
+                push_reply(_L, message); // the request may be gone, e.g. after a reconnect
+                return 3;
+            });
+        }
+    }
+
+    void on_set_reply(const json& message)
+    {
+        const auto key_it = message.find("key");
+        const auto value_it = message.find("value");
+        if (!replaying && key_it != message.end() && key_it->is_string() && value_it != message.end())
+            storage_update(key_it->get<std::string>(), *value_it);
+
+        PendingRequest req = replaying ? PendingRequest() : take_pending_request(message);
+        if (req.is_thread) {
+            resume_waiting("await_set", req.ref, [&](lua_State *co) {
+                push_reply(co, message);
+                return 1;
+            });
+        } else if (req.ref.valid()) {
+            call_handler("Set", req.ref, [&]() {
+                push_reply(_L, message);
+                return 1;
+            }, " callback");
+            unref(req.ref);
+        } else if (set_reply_cb.valid()) {
+            call_handler("set_reply", set_reply_cb, [&]() {
+                push_reply(_L, message); // the request may be gone, e.g. after a reconnect
+                return 1;
+            });
+        }
+    }
+
+    void on_location_info(const std::list<NetworkItem>& items)
+    {
+        const auto scout_it = replaying ? pending_scouts.end() : find_pending_scout(items);
+        if (scout_it != pending_scouts.end()) {
+            LuaRef thread = scout_it->thread;
+            pending_scouts.erase(scout_it);
+            resume_waiting("await_scout", thread, [&items](lua_State *co) {
+                json j = items;
+                json_to_lua(co, j);
+                return 1;
+            });
+            return;
+        }
+
+        if (location_info_cb.valid()) {
+            call_handler("location_info", location_info_cb, [&]() {
+                json j = items;
+                json_to_lua(_L, j);
+                return 1;
+            });
+        }
+    }
+
+    void on_socket_connected()
+    {
+        call_handler("socket_connected", socket_connected_cb, []() {
+            return 0;
+        });
+    }
+
+    void on_socket_error(const std::string& msg)
+    {
+        call_handler("socket_error", socket_error_cb, [&]() {
+            lua_pushstring(_L, msg.c_str());
+            return 1;
+        });
+    }
+
+    void on_room_info()
+    {
+        call_handler("room_info", room_info_cb, []() {
+            return 0;
+        });
+    }
+
+    void on_slot_refused(const std::list<std::string>& reason)
+    {
+        call_handler("slot_refused", slot_refused_cb, [&]() {
+            json j = reason;
+            json_to_lua(_L, j);
+            return 1;
+        });
+    }
+
+    void on_items_received(const std::list<NetworkItem>& items)
+    {
+        if (replaying) {
+            if (items_received_handler_set) {
+                call_handler("items_received", items_received_cb, [&]() {
+                    json j = items;
+                    json_to_lua(_L, j);
+                    return 1;
+                });
             }
-            if (lua_pcall(_L, 1, 0, -3)) {
-                cb_error("location_checked");
+            return;
+        }
+
+        // log items by index while enabled and, after load_state, drop the ones that were already delivered
+        std::list<NetworkItem> fresh;
+        for (const auto& item: items) {
+            const size_t index = (size_t)item.index;
+            const bool delivered = item.index >= 0 && index < received_count; // earlier in this connection
+            if (item.index >= 0 && !delivered)
+                received_count = index + 1;
+            if (!keep_item_log) {
+                fresh.push_back(item);
+                continue;
+            }
+            if (item.index >= 0 && index < item_log.size()) {
+                const auto& logged = item_log[index];
+                if (logged.item == item.item && logged.location == item.location
+                        && logged.player == item.player && logged.flags == item.flags) {
+                    if (!skip_logged_items)
+                        fresh.push_back(item);
+                    continue;
+                }
+                // history differs from the log, deliver everything from here on
+                item_log.resize(index);
+                skip_logged_items = false;
+            }
+            if (item.index >= 0 && index == item_log.size()) {
+                item_log.push_back(item);
+                // filled in by the Sync of set_item_log_enabled
+                if (delivered)
+                    continue;
+            }
+            fresh.push_back(item);
+        }
+
+        if (!items_received_handler_set || fresh.empty())
+            return;
+
+        call_handler("items_received", items_received_cb, [&]() {
+            json j = fresh;
+            json_to_lua(_L, j);
+            return 1;
+        });
+    }
+
+    void on_print(const std::string& msg)
+    {
+        call_handler("print", print_cb, [&]() {
+            lua_pushstring(_L, msg.c_str());
+            return 1;
+        });
+    }
+
+    void on_print_json(const json& command)
+    {
+        call_handler("print_json", print_json_cb, [&]() {
+            json_to_lua(_L, command);
+            if (!lua_checkstack(_L, 2))
+                throw std::runtime_error("Stack overflow");
+            lua_getfield(_L, -1, "data");
+            lua_insert(_L, -2); // first arg is data, second is full command
+            return 2;
+        });
+    }
+
+    void on_data_package_changed(const json& data_package)
+    {
+        // remember checksums for save_state and the size of apclientpp's copy for get_memory_usage
+        const auto games_it = data_package.find("games");
+        if (!replaying && games_it != data_package.end() && games_it->is_object()) {
+            for (const auto& game: games_it->items()) {
+                const auto checksum_it = game.value().find("checksum");
+                if (checksum_it != game.value().end() && checksum_it->is_string())
+                    data_package_checksums[game.key()] = checksum_it->get<std::string>();
             }
-            lua_pop(_L, 1);
+            data_package_size = heap_size(data_package);
+        }
+
+        if (data_package_changed_cb.valid()) {
+            call_handler("data_package_changed", data_package_changed_cb, [&]() {
+                json_to_lua(_L, data_package);
+                return 1;
+            });
         }
     }
 
@@ -255,12 +887,7 @@ public:
 
         APClient* parent = this;
         parent->set_socket_connected_handler([this]() {
-            lua_pushcfunction(_L, error_handler);
-            lua_rawgeti(_L, LUA_REGISTRYINDEX, socket_connected_cb.ref);
-            if (lua_pcall(_L, 0, 0, -2)) {
-                cb_error("socket_connected");
-            }
-            lua_pop(_L, 1);
+            dispatch("socket_connected", &LuaAPClient::on_socket_connected);
         });
     }
 
@@ -271,13 +898,7 @@ public:
 
         APClient* parent = this;
         parent->set_socket_error_handler([this](const std::string& msg) {
-            lua_pushcfunction(_L, error_handler);
-            lua_rawgeti(_L, LUA_REGISTRYINDEX, socket_error_cb.ref);
-            lua_pushstring(_L, msg.c_str());
-            if (lua_pcall(_L, 1, 0, -3)) {
-                cb_error("socket_error");
-            }
-            lua_pop(_L, 1);
+            dispatch("socket_error", &LuaAPClient::on_socket_error, msg);
         });
     }
 
@@ -285,16 +906,6 @@ public:
     {
         unref(socket_disconnected_cb);
         socket_disconnected_cb = ref;
-
-        APClient* parent = this;
-        parent->set_socket_disconnected_handler([this]() {
-            lua_pushcfunction(_L, error_handler);
-            lua_rawgeti(_L, LUA_REGISTRYINDEX, socket_disconnected_cb.ref);
-            if (lua_pcall(_L, 0, 0, -2)) {
-                cb_error("socket_disconnected");
-            }
-            lua_pop(_L, 1);
-        });
     }
 
     void set_room_info_handler(LuaRef ref)
@@ -304,12 +915,7 @@ public:
 
         APClient* parent = this;
         parent->set_room_info_handler([this]() {
-            lua_pushcfunction(_L, error_handler);
-            lua_rawgeti(_L, LUA_REGISTRYINDEX, room_info_cb.ref);
-            if (lua_pcall(_L, 0, 0, -2)) {
-                cb_error("room_info");
-            }
-            lua_pop(_L, 1);
+            dispatch("room_info", &LuaAPClient::on_room_info);
         });
     }
 
@@ -326,16 +932,7 @@ public:
 
         APClient* parent = this;
         parent->set_slot_refused_handler([this](const std::list<std::string>& reason) {
-            lua_pushcfunction(_L, error_handler);
-            lua_rawgeti(_L, LUA_REGISTRYINDEX, slot_refused_cb.ref);
-            {
-                json j = reason;
-                json_to_lua(_L, j);
-            }
-            if (lua_pcall(_L, 1, 0, -3)) {
-                cb_error("slot_refused");
-            }
-            lua_pop(_L, 1);
+            dispatch("slot_refused", &LuaAPClient::on_slot_refused, reason);
         });
     }
 
@@ -345,41 +942,14 @@ public:
 
         unref(items_received_cb);
         items_received_cb = ref;
-
-        APClient* parent = this;
-        parent->set_items_received_handler([this](const std::list<NetworkItem>& items) {
-            lua_pushcfunction(_L, error_handler);
-            lua_rawgeti(_L, LUA_REGISTRYINDEX, items_received_cb.ref);
-            {
-                json j = items;
-                json_to_lua(_L, j);
-            }
-            if (lua_pcall(_L, 1, 0, -3)) {
-                cb_error("items_received");
-            }
-            lua_pop(_L, 1);
-        });
+        items_received_handler_set = true;
     }
 
     void set_location_info_handler(LuaRef ref)
     {
         unref(location_info_cb);
         location_info_cb = ref;
-
-        APClient* parent = this;
-        parent->set_location_info_handler([this](const std::list<NetworkItem>& items) {
-            lua_pushcfunction(_L, error_handler);
-            lua_rawgeti(_L, LUA_REGISTRYINDEX, location_info_cb.ref);
-            {
-                json j = items;
-                json_to_lua(_L, j);
-            }
-            if (lua_pcall(_L, 1, 0, -3)) {
-                cb_error("location_info");
-            }
-            lua_pop(_L, 1);
-        });
-    }
+    }
 
     void set_location_checked_handler(LuaRef ref)
     {
@@ -391,17 +961,6 @@ public:
     {
         unref(data_package_changed_cb);
         data_package_changed_cb = ref;
-
-        APClient* parent = this;
-        parent->set_data_package_changed_handler([this](const json& data_package) {
-            lua_pushcfunction(_L, error_handler);
-            lua_rawgeti(_L, LUA_REGISTRYINDEX, data_package_changed_cb.ref);
-            json_to_lua(_L, data_package);
-            if (lua_pcall(_L, 1, 0, -3)) {
-                cb_error("data_package_changed");
-            }
-            lua_pop(_L, 1);
-        });
     }
 
     void set_print_handler(LuaRef ref)
@@ -411,13 +970,7 @@ public:
 
         APClient* parent = this;
         parent->set_print_handler([this](const std::string& msg) {
-            lua_pushcfunction(_L, error_handler);
-            lua_rawgeti(_L, LUA_REGISTRYINDEX, print_cb.ref);
-            lua_pushstring(_L, msg.c_str());
-            if (lua_pcall(_L, 1, 0, -3)) {
-                cb_error("print");
-            }
-            lua_pop(_L, 1);
+            dispatch("print", &LuaAPClient::on_print, msg);
         });
     }
 
@@ -428,17 +981,7 @@ public:
 
         APClient* parent = this;
         parent->set_print_json_handler([this](const json& command) {
-            lua_pushcfunction(_L, error_handler);
-            lua_rawgeti(_L, LUA_REGISTRYINDEX, print_json_cb.ref);
-            json_to_lua(_L, command);
-            if (!lua_checkstack(_L, 2))
-                throw std::runtime_error("Stack overflow");
-            lua_getfield(_L, -1, "data");
-            lua_insert(_L, -2); // first arg is data, second is full command
-            if (lua_pcall(_L, 2, 0, -4)) {
-                cb_error("print_json");
-            }
-            lua_pop(_L, 1);
+            dispatch("print_json", &LuaAPClient::on_print_json, command);
         });
     }
 
@@ -446,59 +989,48 @@ public:
     {
         unref(bounced_cb);
         bounced_cb = ref;
+    }
 
-        APClient* parent = this;
-        parent->set_bounced_handler([this](const json& bounce) {
-            lua_pushcfunction(_L, error_handler);
-            lua_rawgeti(_L, LUA_REGISTRYINDEX, bounced_cb.ref);
-            json_to_lua(_L, bounce);
-            if (lua_pcall(_L, 1, 0, -3)) {
-                cb_error("bounced");
-            }
-            lua_pop(_L, 1);
-        });
+    void set_bounced_tag_handler(const std::string& tag, LuaRef ref)
+    {
+        auto it = bounced_tag_cbs.find(tag);
+        if (it != bounced_tag_cbs.end()) {
+            unref(it->second);
+            bounced_tag_cbs.erase(it);
+        }
+        if (ref.valid())
+            bounced_tag_cbs[tag] = ref;
+    }
+
+    void set_bounce_echo_suppression(bool enabled)
+    {
+        suppress_bounce_echo = enabled;
+        if (!enabled)
+            sent_bounces.clear();
     }
 
     void set_retrieved_handler(LuaRef ref)
     {
         unref(retrieved_cb);
         retrieved_cb = ref;
-
-        APClient* parent = this;
-        parent->set_retrieved_handler([this](const std::map<std::string, json>& data, const json& message) {
-            lua_pushcfunction(_L, error_handler);
-            lua_rawgeti(_L, LUA_REGISTRYINDEX, retrieved_cb.ref);
-            {
-                json j = data;
-                std::list<std::string> keys;
-                for (const auto& item: j.items())
-                    keys.push_back(item.key());
-                json_to_lua(_L, j);
-                json_to_lua(_L, keys);
-                json_to_lua(_L, message);
-            }
-            if (lua_pcall(_L, 3, 0, -5)) {
-                cb_error("retrieved");
-            }
-            lua_pop(_L, 1);
-        });
     }
 
     void set_set_reply_handler(LuaRef ref)
     {
         unref(set_reply_cb);
         set_reply_cb = ref;
+    }
 
-        APClient* parent = this;
-        parent->set_set_reply_handler([this](const json& message) {
-            lua_pushcfunction(_L, error_handler);
-            lua_rawgeti(_L, LUA_REGISTRYINDEX, set_reply_cb.ref);
-            json_to_lua(_L, message);
-            if (lua_pcall(_L, 1, 0, -3)) {
-                cb_error("set_reply");
-            }
-            lua_pop(_L, 1);
-        });
+    /// Defer handlers called from poll, so they run from a continuation and may yield. Returns false if unsupported.
+    bool set_yieldable_handlers(bool enabled)
+    {
+#if LUA_VERSION_NUM >= 502
+        yieldable_handlers = enabled;
+        return true;
+#else
+        (void)enabled;
+        return false;
+#endif
     }
 
     bool StatusUpdate(int status)
@@ -507,7 +1039,28 @@ public:
         return parent->StatusUpdate((ClientStatus)status);
     }
 
-    bool LocationChecks(const json& j)
+    bool Bounce(const json& data, const std::list<std::string>& games, const std::list<int>& slots,
+                const std::list<std::string>& tags)
+    {
+        APClient* parent = this;
+        if (!suppress_bounce_echo || !data.is_object())
+            return parent->Bounce(data, games, slots, tags);
+
+        // tag what we send with a nonce, so only our own echo is dropped in on_bounced
+        json tagged = data;
+        const std::string nonce = std::to_string(std::uniform_int_distribution<uint64_t>()(rng));
+        tagged[BOUNCE_NONCE_KEY] = nonce;
+        if (!parent->Bounce(tagged, games, slots, tags))
+            return false;
+        sent_bounces.push_back(nonce);
+        if (sent_bounces.size() > MAX_SENT_BOUNCES)
+            sent_bounces.pop_front();
+        return true;
+    }
+
+    /// Send LocationChecks for locations that are not checked yet. While not connected to a slot, checks go to the
+    /// journal instead. Returns true if message was queued or journaled, or if there was nothing new to send.
+    bool LocationChecks(const json& j, size_t& sent, size_t& suppressed)
     {
         std::list<int64_t> locations;
         try {
@@ -518,10 +1071,33 @@ public:
             }
         }
 
+        sent = 0;
+        suppressed = locations.size();
         APClient* parent = this;
-        if (parent->LocationChecks(locations)) {
+        if (parent->get_state() != State::SLOT_CONNECTED) {
+            sent = journal_checks(locations);
+            suppressed -= sent;
+            return true;
+        }
+
+        // drop locations that are checked already, so the server does not have to echo them
+        std::list<int64_t> fresh;
+        const auto& checked = get_checked_locations();
+        std::set<int64_t> seen;
+        for (int64_t location: locations) {
+            if (checked.find(location) == checked.end() && seen.insert(location).second)
+                fresh.push_back(location);
+        }
+        if (fresh.empty())
+            return true;
+
+        if (parent->LocationChecks(fresh)) {
+            sent = fresh.size();
+            suppressed -= sent;
+            known_checked.insert(fresh.begin(), fresh.end());
+
             // sync location tables
-            add_list("checked_locations", locations, 1);
+            add_list("checked_locations", fresh, 1);
             assign_set("missing_locations", get_missing_locations(), 1);
             return true;
         }
@@ -529,19 +1105,133 @@ public:
         return false;
     }
 
-    bool Get(const json& j, const json& extra = json::value_t::null)
+    /// Back the check journal with an append-only file, or only keep it in memory if path is empty.
+    /// Checks left in the file by a previous run are added to the journal. The file starts with a header line
+    /// "# team slot seed" naming the slot the checks were made for, if that was known at the time.
+    void set_check_journal(const std::string& path)
     {
-        APClient* parent = this;
-        if (!extra.is_null() && !extra.is_object()) {
-            throw BadArgumentException(3, "table or nil", "Get");
+        close_check_journal();
+        if (path.empty())
+            return;
+
+        std::list<int64_t> restored;
+        std::string seed;
+        int team = -1;
+        int slot = -1;
+        bool has_content = false;
+        std::ifstream in(path);
+        std::string line;
+        // a line without newline may be cut off by a crash, so ignore it
+        while (std::getline(in, line) && !in.eof()) {
+            has_content = true;
+            if (!line.empty() && line[0] == '#') {
+                parse_journal_header(line, team, slot, seed);
+                continue;
+            }
+            try {
+                restored.push_back((int64_t)std::stoll(line));
+            } catch (const std::exception&) {
+            }
+        }
+        in.close();
+
+        if (!seed.empty() && !journal_seed.empty() && !check_journal.empty()
+                && (seed != journal_seed || team != journal_team || slot != journal_slot))
+            throw std::runtime_error("Check journal is for a different slot: " + path);
+
+        check_journal_file = fopen(path.c_str(), "ab");
+        if (!check_journal_file)
+            throw std::runtime_error("Could not open " + path);
+        check_journal_path = path;
+        check_journal_header_written = has_content;
+        if (!seed.empty()) {
+            journal_seed = seed;
+            journal_team = team;
+            journal_slot = slot;
         }
+        // entries are in the file already, only add them to memory
+        const std::list<int64_t> added = add_to_check_journal(restored);
+        if (!added.empty()) {
+            add_list("checked_locations", added, 1);
+            assign_set("missing_locations", get_missing_unjournaled(), 1);
+        }
+    }
+
+    size_t get_check_journal_size() const
+    {
+        return check_journal.size();
+    }
+
+    /// Send Get. If req has a valid ref, this takes ownership and the reply will be routed to it.
+    bool Get(const json& j, const json& extra = json::value_t::null, PendingRequest req = {})
+    {
+        APClient* parent = this;
         std::list<std::string> keys;
         try {
-            keys = j.get<std::list<std::string>>();
-        } catch (const std::exception&) {
-            throw BadArgumentException(2, "array of string", "Get");
+            if (!extra.is_null() && !extra.is_object()) {
+                throw BadArgumentException(3, "table or nil", "Get");
+            }
+            try {
+                keys = j.get<std::list<std::string>>();
+            } catch (const std::exception&) {
+                throw BadArgumentException(2, "array of string", "Get");
+            }
+        } catch (...) {
+            unref(req.ref);
+            throw;
+        }
+        if (!req.ref.valid())
+            return parent->Get(keys, extra);
+
+        json extra_with_id = extra.is_null() ? json::object() : extra;
+        extra_with_id[REQUEST_ID_KEY] = next_request_id;
+        bool sent;
+        try {
+            sent = parent->Get(keys, extra_with_id);
+        } catch (...) {
+            unref(req.ref);
+            throw;
+        }
+        return add_pending_request(req, sent);
+    }
+
+    /// Send Set. If req has a valid ref, this takes ownership, a reply is requested and routed to it.
+    bool Set(const std::string& key, const json& dflt, bool want_reply,
+             const std::list<DataStorageOperation>& operations, const json& extra, PendingRequest req = {})
+    {
+        APClient* parent = this;
+        if (!req.ref.valid())
+            return parent->Set(key, dflt, want_reply, operations, extra);
+
+        bool sent;
+        try {
+            json extra_with_id = extra.is_null() ? json::object() : extra;
+            extra_with_id[REQUEST_ID_KEY] = next_request_id;
+            sent = parent->Set(key, dflt, true, operations, extra_with_id);
+        } catch (...) {
+            unref(req.ref);
+            throw;
+        }
+        return add_pending_request(req, sent);
+    }
+
+    /// Send LocationScouts and have the reply resume thread. This takes ownership of thread.
+    bool await_scout(const std::list<int64_t>& locations, int create_as_hint, LuaRef thread)
+    {
+        APClient* parent = this;
+        bool sent;
+        try {
+            sent = parent->LocationScouts(locations, create_as_hint);
+        } catch (...) {
+            unref(thread);
+            throw;
         }
-        return parent->Get(keys, extra);
+        if (!sent) {
+            unref(thread);
+            return false;
+        }
+        pending_scouts.push_back({{locations.begin(), locations.end()}, thread});
+        return true;
     }
 
     bool SetNotify(const json& j)
@@ -553,10 +1243,361 @@ public:
             throw BadArgumentException(2, "array of string", "SetNotify");
         }
 
+        // remember keys, so we can re-subscribe after reconnecting
+        storage_notify_keys.insert(keys.begin(), keys.end());
+
         APClient* parent = this;
         return parent->SetNotify(keys);
     }
 
+    void reset()
+    {
+        APClient* parent = this;
+        parent->reset();
+        storage.clear();
+        storage_notify_keys.clear();
+        last_state = State::DISCONNECTED;
+        socket_dropped = false;
+        reconnect_attempts = 0;
+        reconnect_at = {};
+        reconnect_gave_up = false;
+    }
+
+    void set_reconnect_policy(const ReconnectPolicy& policy)
+    {
+        reconnect_policy = policy;
+        reconnect_at = {};
+        reconnect_gave_up = false;
+    }
+
+    /// Record received events to path, or stop recording if path is empty.
+    /// Layout: magic, u32 version, then per event u32 length + msgpack [seconds since start, name, [args...]].
+    void set_capture(const std::string& path)
+    {
+        if (capture_file)
+            fclose(capture_file);
+        capture_file = nullptr;
+        if (path.empty())
+            return;
+
+        capture_file = fopen(path.c_str(), "wb");
+        if (!capture_file)
+            throw std::runtime_error("Could not open " + path);
+        StateWriter w;
+        w.data.append(CAPTURE_MAGIC, 4);
+        w.u32(CAPTURE_VERSION);
+        fwrite(w.data.data(), 1, w.data.size(), capture_file);
+        capture_start = std::chrono::steady_clock::now();
+    }
+
+    /// Feed events recorded by set_capture into the handlers, without a socket. With realtime, the original timing
+    /// is kept, otherwise events are replayed as fast as possible. Returns the number of events replayed.
+    size_t replay(const std::string& path, bool realtime)
+    {
+        std::ifstream f(path, std::ios::binary);
+        if (!f)
+            throw std::runtime_error("Could not open " + path);
+        const std::string data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        if (data.compare(0, 4, CAPTURE_MAGIC, 4) != 0)
+            throw std::runtime_error("Not a capture file: " + path);
+
+        StateReader r(data);
+        r.u32(); // magic
+        if (r.u32() != CAPTURE_VERSION)
+            throw std::runtime_error("Unsupported capture file version: " + path);
+
+        // only handlers run, the client's own state is left alone
+        size_t count;
+        replaying = true;
+        try {
+            count = replay_events(r, realtime);
+        } catch (...) {
+            replaying = false;
+            throw;
+        }
+        replaying = false;
+
+        if (!errors.empty()) {
+            std::string message;
+            message.swap(errors);
+            throw std::runtime_error(message);
+        }
+        return count;
+    }
+
+    /// Enable timing of handler calls. While disabled, handlers only pay for checking the flag.
+    void set_stats_enabled(bool enabled)
+    {
+        stats_enabled = enabled;
+    }
+
+    /// Timing by handler name, e.g. "items_received_handler" or "Get callback"
+    const std::map<std::string, HandlerStats>& get_stats() const
+    {
+        return handler_stats;
+    }
+
+    void reset_stats()
+    {
+        handler_stats.clear();
+    }
+
+    const Metrics& get_metrics() const
+    {
+        return metrics;
+    }
+
+    /// Report handler calls that take longer than budget to cb, or to a rate-limited log if cb is not set.
+    /// A budget of 0 disables the check.
+    void set_handler_budget(std::chrono::nanoseconds budget, LuaRef cb)
+    {
+        unref(handler_budget_cb);
+        handler_budget = budget;
+        handler_budget_cb = cb;
+        budget_log_suppressed = 0;
+        budget_log_next = {};
+    }
+
+    /// Record spans of polls, events, handlers and commands into a ring buffer of the last capacity spans.
+    /// 0 disables tracing and discards recorded spans.
+    void set_tracing(size_t capacity)
+    {
+        trace.clear();
+        trace.shrink_to_fit();
+        trace_capacity = capacity;
+        trace_next = 0;
+    }
+
+    /// Write recorded spans as Chrome Trace Event JSON, oldest first. Returns the number of spans written.
+    size_t dump_trace(const std::string& path) const
+    {
+        json spans = json::array();
+        for (size_t i = 0; i < trace.size(); i++) {
+            const TraceSpan& span = trace[(trace_next + i) % trace.size()];
+            spans.push_back({
+                {"name", span.name},
+                {"cat", span.cat},
+                {"ph", "X"},
+                {"ts", std::chrono::duration<double, std::micro>(span.start.time_since_epoch()).count()},
+                {"dur", std::chrono::duration<double, std::micro>(span.duration).count()},
+                {"pid", 1},
+                {"tid", span.tid},
+            });
+        }
+        std::ofstream f(path, std::ios::binary | std::ios::trunc);
+        if (!f)
+            throw std::runtime_error("Could not open " + path);
+        f << json{{"traceEvents", spans}, {"displayTimeUnit", "ms"}}.dump();
+        f.close();
+        if (!f)
+            throw std::runtime_error("Could not write " + path);
+        return trace.size();
+    }
+
+    /// Run f, recording it as a span while tracing
+    template <class F>
+    auto traced(const char* name, F f, const char* cat = "command") -> decltype(f())
+    {
+        if (!trace_capacity)
+            return f();
+        TraceScope scope(this, name, cat);
+        return f();
+    }
+
+    /// Number of entries in internal queues by name
+    std::map<std::string, size_t> get_queue_depths() const
+    {
+        return {
+            {"events", events.size()},
+#if LUA_VERSION_NUM >= 502
+            {"deferred_calls", deferred_calls.size()},
+#endif
+            {"pending_requests", pending_requests.size()},
+            {"pending_scouts", pending_scouts.size()},
+            {"check_journal", check_journal.size()},
+        };
+    }
+
+    /// Estimated heap bytes held by the wrapper by category. The data package is the copy held by apclientpp.
+    std::map<std::string, size_t> get_memory_usage() const
+    {
+        size_t storage_size = heap_size(storage_notify_keys);
+        for (const auto& key: storage_notify_keys)
+            storage_size += heap_size(key);
+        for (const auto& pair: storage)
+            storage_size += TREE_NODE_OVERHEAD + sizeof(pair) + heap_size(pair.first) + heap_size(pair.second.value);
+
+        size_t pending = pending_requests.size() * (TREE_NODE_OVERHEAD + sizeof(std::pair<uint64_t, PendingRequest>))
+                + events.size() * (LIST_NODE_OVERHEAD + sizeof(std::function<void()>))
+                + check_journal.size() * (LIST_NODE_OVERHEAD + sizeof(int64_t));
+        for (const auto& scout: pending_scouts)
+            pending += LIST_NODE_OVERHEAD + sizeof(scout) + heap_size(scout.locations);
+        for (const auto& bounce: sent_bounces)
+            pending += LIST_NODE_OVERHEAD + sizeof(bounce) + heap_size(bounce);
+
+        size_t diagnostics = trace.capacity() * sizeof(TraceSpan);
+        for (const auto& span: trace)
+            diagnostics += heap_size(span.name);
+        for (const auto& pair: handler_stats)
+            diagnostics += TREE_NODE_OVERHEAD + sizeof(pair) + heap_size(pair.first);
+
+        std::map<std::string, size_t> res = {
+            {"data_package", data_package_size},
+            {"item_log", item_log.capacity() * sizeof(NetworkItem)},
+            {"location_sets", heap_size(get_checked_locations()) + heap_size(get_missing_locations())
+                    + heap_size(known_checked)},
+            {"storage", storage_size},
+            {"pending", pending},
+            {"diagnostics", diagnostics},
+        };
+        size_t total = 0;
+        for (const auto& pair: res)
+            total += pair.second;
+        res["total"] = total;
+        return res;
+    }
+
+    const ConnectionStats& get_connection_stats() const
+    {
+        return connection_stats;
+    }
+
+    /// Write received items, checked locations and data package checksums to path.
+    /// Layout: magic, u32 version, seed, i32 team, i32 slot, u32 count + (game, checksum),
+    /// u32 count + i64 location, u32 count + (i64 item, i64 location, i32 player, u32 flags) in index order.
+    /// Strings are u32 length + bytes, all integers are little-endian.
+    void save_state(const std::string& path) const
+    {
+        StateWriter w;
+        w.data.append(STATE_MAGIC, 4);
+        w.u32(STATE_VERSION);
+        w.str(item_log_seed);
+        w.i32(item_log_team);
+        w.i32(item_log_slot);
+        w.u32((uint32_t)data_package_checksums.size());
+        for (const auto& pair: data_package_checksums) {
+            w.str(pair.first);
+            w.str(pair.second);
+        }
+        w.u32((uint32_t)known_checked.size());
+        for (int64_t location: known_checked)
+            w.i64(location);
+        w.u32((uint32_t)item_log.size());
+        for (const auto& item: item_log) {
+            w.i64(item.item);
+            w.i64(item.location);
+            w.i32(item.player);
+            w.u32(item.flags);
+        }
+
+        // write a temporary file first, so a crash does not leave a broken snapshot behind
+        const std::string tmp = path + ".tmp";
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f)
+            throw std::runtime_error("Could not open " + tmp);
+        f.write(w.data.data(), (std::streamsize)w.data.size());
+        f.close();
+        if (!f)
+            throw std::runtime_error("Could not write " + tmp);
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+            // rename does not replace existing files on Windows
+            std::remove(path.c_str());
+            if (std::rename(tmp.c_str(), path.c_str()) != 0)
+                throw std::runtime_error("Could not write " + path);
+        }
+    }
+
+    /// Restore a snapshot written by save_state. Items in it will not be passed to items_received again when
+    /// the server replays them for the same slot. Returns the data package checksums stored in the snapshot.
+    std::map<std::string, std::string> load_state(const std::string& path)
+    {
+        std::ifstream f(path, std::ios::binary);
+        if (!f)
+            throw std::runtime_error("Could not open " + path);
+        const std::string data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        if (data.compare(0, 4, STATE_MAGIC, 4) != 0)
+            throw std::runtime_error("Not a state file: " + path);
+
+        StateReader r(data);
+        r.u32(); // magic
+        if (r.u32() != STATE_VERSION)
+            throw std::runtime_error("Unsupported state file version: " + path);
+        std::string seed = r.str();
+        int team = r.i32();
+        int slot = r.i32();
+        std::map<std::string, std::string> checksums;
+        for (uint32_t n = r.u32(); n > 0; n--) {
+            std::string game = r.str();
+            checksums[game] = r.str();
+        }
+        std::set<int64_t> checked;
+        for (uint32_t n = r.u32(); n > 0; n--)
+            checked.insert(r.i64());
+        std::vector<NetworkItem> items;
+        for (uint32_t n = r.u32(); n > 0; n--) {
+            NetworkItem item;
+            item.item = r.i64();
+            item.location = r.i64();
+            item.player = r.i32();
+            item.flags = r.u32();
+            item.index = (int)items.size();
+            items.push_back(item);
+        }
+        if (!r.done())
+            throw std::runtime_error("Trailing data in state file: " + path);
+
+        APClient* parent = this;
+        const bool connected = parent->get_state() == State::SLOT_CONNECTED;
+        if (connected && (seed != get_seed() || team != get_team_number() || slot != get_player_number()))
+            throw std::runtime_error("State file is for a different slot: " + path);
+
+        keep_item_log = true;
+        item_log = std::move(items);
+        item_log_seed = seed;
+        item_log_team = team;
+        item_log_slot = slot;
+        skip_logged_items = true;
+        if (connected) {
+            // the server is authoritative while connected
+            known_checked.insert(checked.begin(), checked.end());
+        } else {
+            known_checked = std::move(checked);
+            assign_set("checked_locations", known_checked, 1);
+        }
+        return checksums;
+    }
+
+    /// Keep received items for save_state. Enabling while connected requests all items again with Sync to fill
+    /// in the ones that were received before, without passing them to items_received again.
+    void set_item_log_enabled(bool enabled)
+    {
+        if (!enabled) {
+            keep_item_log = false;
+            item_log.clear();
+            item_log.shrink_to_fit();
+            skip_logged_items = false;
+            return;
+        }
+        if (keep_item_log)
+            return;
+        keep_item_log = true;
+        APClient* parent = this;
+        if (parent->get_state() == State::SLOT_CONNECTED && item_log.size() < received_count)
+            parent->Sync();
+    }
+
+    /// Returns the locally mirrored value for key or nullptr if unknown. version is 0 if unknown.
+    const json* storage_get(const std::string& key, uint64_t& version) const
+    {
+        const auto it = storage.find(key);
+        if (it == storage.end()) {
+            version = 0;
+            return nullptr;
+        }
+        version = it->second.version;
+        return &it->second.value;
+    }
+
     int get_state() const
     {
         const APClient* parent = this;
@@ -575,9 +1616,37 @@ public:
         return parent->get_permissions();
     }
 
+    /// Pass socket_connected and room_info to the handlers that are set before the next poll.
+    /// Used for the winner of a race, which connected before it was returned.
+    void replay_connection_events()
+    {
+        replay_connection = true;
+    }
+
+    /// Run the native part of poll on a worker thread. Events are queued and run by the next poll on the Lua thread.
+    void poll_native()
+    {
+        APClient* parent = this;
+        queue_events = true;
+        native_poll_start = std::chrono::steady_clock::now();
+        try {
+            if (!reconnect_blocked())
+                parent->poll();
+        } catch (const std::exception& ex) {
+            native_error = ex.what();
+        } catch (...) {
+            native_error = "Unknown error in poll";
+        }
+        metrics.native_time += std::chrono::steady_clock::now() - native_poll_start;
+        add_trace_span("native_poll", "poll", native_poll_start);
+        queue_events = false;
+        native_polled = true;
+    }
+
     static int poll(lua_State *L)
     {
         LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+        const auto poll_start = std::chrono::steady_clock::now();
         try {
             if (self->_L != L) {
                 const char* msg = "Lua state changed. Multi-threading not supported!";
@@ -585,11 +1654,47 @@ public:
                 luaL_error(L, "%s", msg);
                 return 0;
             }
+#if LUA_VERSION_NUM >= 502
+            if (self->deferred_running) {
+                // the running handlers keep their state in the client
+                luaL_error(L, "poll called from a handler or while a handler is yielded");
+                return 0;
+            }
+#endif
             APClient* parent = self;
-            parent->poll();
+            self->polling = true;
+            if (self->replay_connection) {
+                // won a race: the connection was made before handlers could be set
+                self->replay_connection = false;
+                if (self->socket_connected_cb.valid())
+                    self->dispatch("socket_connected", &LuaAPClient::on_socket_connected);
+                if (self->room_info_cb.valid() && parent->get_state() >= State::ROOM_INFO)
+                    self->dispatch("room_info", &LuaAPClient::on_room_info);
+            }
+            if (self->native_polled) {
+                // native part already ran on a worker thread
+                self->native_polled = false;
+                self->run_events();
+                self->track_connection(self->native_poll_start);
+            } else if (!self->reconnect_blocked()) {
+                const auto event_time = self->metrics.event_time;
+                self->traced("native_poll", [parent]() { parent->poll(); }, "poll");
+                // events were handled from inside apclientpp's poll, don't count them twice
+                self->metrics.native_time += std::chrono::steady_clock::now() - poll_start
+                        - (self->metrics.event_time - event_time);
+                self->track_connection(poll_start);
+            }
         } catch (const std::exception& ex) {
             self->push_error(ex.what());
         }
+        self->polling = false;
+
+        const std::chrono::nanoseconds poll_time = std::chrono::steady_clock::now() - poll_start;
+        self->add_trace_span("poll", "poll", poll_start);
+        self->metrics.polls++;
+        self->metrics.poll_time += poll_time;
+        if (poll_time > self->metrics.max_poll_time)
+            self->metrics.max_poll_time = poll_time;
 
         if (!self->errors.empty()) {
             lua_pushstring(L, self->errors.c_str());
@@ -602,6 +1707,20 @@ public:
         return 1;
     }
 
+#if LUA_VERSION_NUM >= 502
+    /// Run handlers that were deferred during poll. Expects self at index 1, discards the rest of the stack.
+    static int call_deferred(lua_State *L)
+    {
+        LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+        if (self->deferred_calls.empty())
+            return 1; // result of poll
+        lua_settop(L, 1);
+        lua_pushcfunction(L, error_handler); // stays at index 2
+        self->deferred_running = true;
+        return call_deferred_continue(L, LUA_OK);
+    }
+#endif
+
     // lua interface implementation details
 
 #if !defined _MSC_VER || _MSC_VER >= 1911
@@ -662,54 +1781,699 @@ private:
         ref = {};
     }
 
-    void cb_error(const std::string& name)
+    void cb_error(const std::string& name, const char* kind = "_handler")
     {
+        if (stats_enabled)
+            handler_stats[name + kind].errors++;
         const char* err = lua_tostring(_L, -1);
-        std::string error_message = "Error calling " + name + "_handler:\n" + (err ? err : "<null>");
+        std::string error_message = "Error calling " + name + kind + ":\n" + (err ? err : "<null>");
         push_error(error_message);
         lua_pop(_L, 1); // pop error
     }
 
-    void print_error(const std::string& message)
+    void track_connection(std::chrono::steady_clock::time_point poll_start)
     {
-        errorf(_L, "%s", message.c_str());
+        const APClient* parent = this;
+        State state = parent->get_state();
+        if ((last_state == State::DISCONNECTED || socket_dropped) && state != State::DISCONNECTED) {
+            connection_stats.attempts++;
+            reconnect_attempts++;
+            connect_start = poll_start;
+        }
+        if ((last_state < State::ROOM_INFO || socket_dropped) && state >= State::ROOM_INFO) {
+            std::chrono::duration<double> t = std::chrono::steady_clock::now() - connect_start;
+            connection_stats.connects++;
+            connection_stats.last_connect_time = t.count();
+            connection_stats.total_connect_time += t.count();
+            reconnect_attempts = 0;
+        }
+        if (state == State::DISCONNECTED && (last_state != State::DISCONNECTED || socket_dropped)) {
+            schedule_reconnect();
+        }
+        socket_dropped = false;
+        last_state = state;
     }
 
-    void push_error(const std::string& message)
+    void schedule_reconnect()
     {
-        print_error(message.c_str());
-        if (!errors.empty())
-            errors += "\n---\n";
-        errors += message;
+        if (!reconnect_policy.enabled)
+            return;
+        if (reconnect_policy.max_attempts && reconnect_attempts >= reconnect_policy.max_attempts) {
+            reconnect_gave_up = true;
+            if (socket_error_cb.valid()) {
+                dispatch("socket_error", &LuaAPClient::on_socket_error,
+                         "Giving up after " + std::to_string(reconnect_attempts) + " connection attempts");
+            }
+            return;
+        }
+        double delay = reconnect_policy.min_delay;
+        for (uint64_t i = 0; i < reconnect_attempts && delay < reconnect_policy.max_delay; i++)
+            delay *= 2;
+        delay = std::min(delay, reconnect_policy.max_delay);
+        if (reconnect_policy.jitter > 0) {
+            std::uniform_real_distribution<double> dist(-reconnect_policy.jitter, reconnect_policy.jitter);
+            delay *= 1 + dist(rng);
+        }
+        reconnect_at = std::chrono::steady_clock::now()
+                + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(delay));
     }
 
-    static int error_handler(lua_State *L)
+    /// Returns true while the reconnect policy holds back the next connection attempt
+    bool reconnect_blocked() const
     {
-        lua_getglobal(L, "debug");
-        if (lua_istable(L, -1)) {
-            lua_getfield(L, -1, "traceback");
-            if (lua_isfunction(L, -1)) {
-                lua_pushvalue(L, -3); // original message
-                lua_pushinteger(L, 2); // don't show error_handler
-                if (lua_pcall(L, 2, 1, 0) == LUA_OK) {
-                    // stack: original error, debug, message
-                    lua_replace(L, -3);
-                } else {
-                    lua_pop(L, 1); // pop error
-                }
-            } else {
-                lua_pop(L, 1); // pop traceback
+        if (!reconnect_policy.enabled)
+            return false;
+        const APClient* parent = this;
+        if (parent->get_state() != State::DISCONNECTED)
+            return false;
+        return reconnect_gave_up || std::chrono::steady_clock::now() < reconnect_at;
+    }
+
+    /// Call handler f with args now, or queue it with a copy of args while polling on a worker thread.
+    /// name is the event name used for capture and replay.
+    template <class... Params, class... Args>
+    void dispatch(const char* name, void (LuaAPClient::*f)(Params...), const Args&... args)
+    {
+        if (capture_file)
+            capture_event(name, json::array({json(args)...}));
+        metrics.events[name]++;
+        if (queue_events) {
+            events.push_back(std::bind(f, this, args...));
+        } else {
+            const auto start = std::chrono::steady_clock::now();
+            (this->*f)(args...);
+            metrics.event_time += std::chrono::steady_clock::now() - start;
+            add_trace_span(name, "event", start);
+        }
+    }
+
+    void capture_event(const char* name, const json& args)
+    {
+        const double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - capture_start).count();
+        const std::vector<uint8_t> record = json::to_msgpack(json::array({t, name, args}));
+        StateWriter w;
+        w.str(std::string(record.begin(), record.end()));
+        fwrite(w.data.data(), 1, w.data.size(), capture_file);
+    }
+
+    struct Replayer {
+        LuaRef LuaAPClient::*cb; // handler that has to be set for apclientpp to report the event, or nullptr
+        void (*replay)(LuaAPClient* self, const json& args);
+    };
+
+    template <class... Params, size_t... I>
+    void replay_call(void (LuaAPClient::*f)(Params...), const json& args, std::index_sequence<I...>)
+    {
+        (this->*f)(args.at(I).get<typename std::decay<Params>::type>()...);
+    }
+
+    template <class... Params>
+    void replay_call(void (LuaAPClient::*f)(Params...), const json& args)
+    {
+        replay_call(f, args, std::index_sequence_for<Params...>());
+    }
+
+    size_t replay_events(StateReader& r, bool realtime)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        size_t count = 0;
+        while (!r.done()) {
+            const std::string record = r.str();
+            const json event = json::from_msgpack(record);
+            if (realtime) {
+                std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        std::chrono::duration<double>(event.at(0).get<double>())));
             }
+            const auto it = replayers().find(event.at(1).get<std::string>());
+            if (it == replayers().end())
+                continue; // recorded by a newer version
+            const Replayer& replayer = it->second;
+            if (replayer.cb && !(this->*replayer.cb).valid())
+                continue; // apclientpp would not call this without a handler either
+            replayer.replay(this, event.at(2));
+            count++;
         }
-        lua_pop(L, 1); // pop debug
-        return 1; // original error or traceback
+        return count;
     }
 
-    template <class T>
-    void assign_set(const char* key, const std::set<T>& set, int table = -1)
+#define REPLAYER(event, cb) \
+    {#event, {cb, [](LuaAPClient* self, const json& args) { self->replay_call(&LuaAPClient::on_##event, args); }}}
+
+    static const std::map<std::string, Replayer>& replayers()
     {
-        // ensure stack space
-        if (!lua_checkstack(_L, 3))
+        static const std::map<std::string, Replayer> map = {
+            REPLAYER(socket_connected, &LuaAPClient::socket_connected_cb),
+            REPLAYER(socket_error, &LuaAPClient::socket_error_cb),
+            REPLAYER(socket_disconnected, nullptr),
+            REPLAYER(room_info, &LuaAPClient::room_info_cb),
+            REPLAYER(slot_connected, nullptr),
+            REPLAYER(slot_refused, &LuaAPClient::slot_refused_cb),
+            REPLAYER(items_received, nullptr),
+            REPLAYER(location_info, nullptr),
+            REPLAYER(location_checked, nullptr),
+            REPLAYER(data_package_changed, nullptr),
+            REPLAYER(print, &LuaAPClient::print_cb),
+            REPLAYER(print_json, &LuaAPClient::print_json_cb),
+            REPLAYER(bounced, nullptr),
+            REPLAYER(retrieved, nullptr),
+            REPLAYER(set_reply, nullptr),
+        };
+        return map;
+    }
+
+#undef REPLAYER
+
+    void run_events()
+    {
+        if (!native_error.empty()) {
+            push_error(native_error);
+            native_error.clear();
+        }
+        // handlers may poll again, so take the events out first
+        std::list<std::function<void()>> queued;
+        queued.swap(events);
+        const auto start = std::chrono::steady_clock::now();
+        for (auto& event: queued)
+            event();
+        metrics.event_time += std::chrono::steady_clock::now() - start;
+    }
+
+    struct TraceSpan {
+        std::string name;
+        const char* cat;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::nanoseconds duration;
+        uint32_t tid;
+    };
+
+    /// Records a span from construction to destruction
+    struct TraceScope {
+        TraceScope(LuaAPClient* self, const char* name, const char* cat)
+            : self(self), name(name), cat(cat), start(std::chrono::steady_clock::now())
+        {
+        }
+
+        ~TraceScope()
+        {
+            self->add_trace_span(name, cat, start);
+        }
+
+        LuaAPClient* self;
+        const char* name;
+        const char* cat;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    /// Record a span if tracing is enabled, only building the name when it is
+    void add_trace_span(const char* name, const char* cat, std::chrono::steady_clock::time_point start)
+    {
+        if (trace_capacity)
+            add_trace_span(std::string(name), cat, start);
+    }
+
+    void add_trace_span(std::string name, const char* cat, std::chrono::steady_clock::time_point start)
+    {
+        if (!trace_capacity)
+            return;
+        // spans are added from the thread that polls, which may be a worker thread
+        const auto tid = (uint32_t)(std::hash<std::thread::id>()(std::this_thread::get_id()) & 0x7fffffff);
+        TraceSpan span = {std::move(name), cat, start, std::chrono::steady_clock::now() - start, tid};
+        if (trace.size() < trace_capacity)
+            trace.push_back(std::move(span));
+        else
+            trace[trace_next] = std::move(span);
+        trace_next = (trace_next + 1) % trace_capacity;
+    }
+
+    /// Handler name as used in errors and stats, e.g. "bounced_tag(tag)"
+    static std::string handler_name(const char* name, const std::string* arg)
+    {
+        return arg ? std::string(name) + "(" + *arg + ")" : std::string(name);
+    }
+
+    /// Call cb with the arguments pushed by push_args, which returns their count.
+    /// With yieldable handlers enabled, calls from inside poll are deferred until apclientpp returns.
+    /// The name for errors and stats is only built when needed, from name, the optional arg and kind.
+    template <class F>
+    void call_handler(const char* name, const LuaRef& cb, F push_args, const char* kind = "_handler",
+                      const std::string* arg = nullptr)
+    {
+        if (!lua_checkstack(_L, 2))
+            throw std::runtime_error("Stack overflow");
+        // handlers may toggle stats, so only look at the flag once
+        const bool timed = stats_enabled;
+        const bool traced = trace_capacity > 0;
+        const bool budgeted = handler_budget.count() > 0 && !over_budget_reporting;
+        std::chrono::steady_clock::time_point start, pushed, end;
+        if (timed || traced || budgeted)
+            start = std::chrono::steady_clock::now();
+        lua_pushcfunction(_L, error_handler);
+        lua_rawgeti(_L, LUA_REGISTRYINDEX, cb.ref);
+        int nargs = push_args();
+        if (timed)
+            pushed = std::chrono::steady_clock::now();
+#if LUA_VERSION_NUM >= 502
+        if (yieldable_handlers && polling) {
+            defer_call(handler_name(name, arg), kind, nargs);
+            lua_pop(_L, 1); // pop error_handler
+            if (timed)
+                add_handler_stats(handler_name(name, arg) + kind, pushed - start, {});
+            if (traced)
+                add_trace_span(handler_name(name, arg) + kind, "handler", start);
+            return;
+        }
+#endif
+        int status = lua_pcall(_L, nargs, 0, -(nargs + 2));
+        if (timed || budgeted)
+            end = std::chrono::steady_clock::now();
+        const bool over = budgeted && end - start > handler_budget;
+        std::string key;
+        if (timed || traced || over)
+            key = handler_name(name, arg) + kind;
+        if (timed)
+            add_handler_stats(key, pushed - start, end - pushed);
+        if (traced)
+            add_trace_span(key, "handler", start);
+        if (status) {
+            cb_error(handler_name(name, arg), kind);
+        }
+        lua_pop(_L, 1);
+        if (over)
+            over_budget(key, end - start);
+    }
+
+    void over_budget(const std::string& key, std::chrono::nanoseconds duration)
+    {
+        if (stats_enabled)
+            handler_stats[key].over_budget++;
+        const double seconds = std::chrono::duration<double>(duration).count();
+        if (handler_budget_cb.valid()) {
+            // the callback itself is not checked against the budget
+            over_budget_reporting = true;
+            call_handler("handler_budget", handler_budget_cb, [&]() {
+                lua_pushstring(_L, key.c_str());
+                lua_pushnumber(_L, seconds);
+                return 2;
+            }, "_callback");
+            over_budget_reporting = false;
+            return;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        if (now < budget_log_next) {
+            budget_log_suppressed++;
+            return;
+        }
+        char buf[128];
+        snprintf(buf, sizeof(buf), " took %.1fms, budget is %.1fms", seconds * 1000.,
+                 std::chrono::duration<double, std::milli>(handler_budget).count());
+        std::string message = key + buf;
+        if (budget_log_suppressed)
+            message += " (" + std::to_string(budget_log_suppressed) + " more calls over budget not logged)";
+        print_error(message);
+        budget_log_suppressed = 0;
+        budget_log_next = now + std::chrono::seconds(10);
+    }
+
+    void add_handler_stats(const std::string& key, std::chrono::nanoseconds marshal_time,
+                           std::chrono::nanoseconds lua_time)
+    {
+        HandlerStats& stats = handler_stats[key];
+        const auto total = marshal_time + lua_time;
+        stats.calls++;
+        stats.marshal_time += marshal_time;
+        stats.lua_time += lua_time;
+        if (total < stats.min_time)
+            stats.min_time = total;
+        if (total > stats.max_time)
+            stats.max_time = total;
+        const auto us = std::chrono::duration_cast<std::chrono::microseconds>(total).count();
+        size_t bucket = 0;
+        while (bucket < HandlerStats::BUCKETS - 1 && (1LL << bucket) <= us)
+            bucket++;
+        stats.histogram[bucket]++;
+    }
+
+#if LUA_VERSION_NUM >= 502
+    struct DeferredCall {
+        std::string name;
+        const char* kind;
+        LuaRef call; // table of function and arguments
+        int nargs;
+    };
+
+    /// Pop function and nargs arguments into a table and queue it
+    void defer_call(const std::string& name, const char* kind, int nargs)
+    {
+        lua_createtable(_L, nargs + 1, 0);
+        lua_insert(_L, -(nargs + 2));
+        int t = lua_gettop(_L) - nargs - 1;
+        for (int i = nargs + 1; i >= 1; i--)
+            lua_rawseti(_L, t, i); // pops top
+        LuaRef call;
+        call.ref = luaL_ref(_L, LUA_REGISTRYINDEX);
+        deferred_calls.push_back({name, kind, call, nargs});
+    }
+
+    /// Finish the current deferred call with status, then run the remaining ones.
+    /// Stack is self, error_handler. No C++ objects with destructors may be alive here, since handlers may yield.
+    static int call_deferred_continue(lua_State *L, int status)
+    {
+        LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+        for (;;) {
+            if (status != LUA_OK && status != LUA_YIELD)
+                self->cb_error(self->current_call.name, self->current_call.kind);
+            if (self->deferred_calls.empty())
+                break;
+            self->current_call = std::move(self->deferred_calls.front());
+            self->deferred_calls.pop_front();
+            int nargs = self->current_call.nargs;
+            if (!lua_checkstack(L, nargs + 2))
+                return luaL_error(L, "Stack overflow");
+            lua_rawgeti(L, LUA_REGISTRYINDEX, self->current_call.call.ref);
+            self->unref(self->current_call.call);
+            for (int i = 1; i <= nargs + 1; i++)
+                lua_rawgeti(L, 3, i);
+            lua_remove(L, 3); // remove table
+            const auto start = std::chrono::steady_clock::now();
+            status = lua_pcallk(L, nargs, 0, 2, 0, call_deferred_k);
+            // only reached if the handler did not yield, time spent yielded does not block the caller
+            self->check_deferred_budget(start);
+        }
+
+        self->deferred_running = false;
+        if (!self->errors.empty()) {
+            lua_pushstring(L, self->errors.c_str());
+            self->errors.clear();
+            return lua_error(L);
+        }
+        lua_pushboolean(L, true);
+        return 1;
+    }
+
+    /// Report the current deferred call if it took longer than the budget
+    void check_deferred_budget(std::chrono::steady_clock::time_point start)
+    {
+        if (handler_budget.count() <= 0 || over_budget_reporting)
+            return;
+        const std::chrono::nanoseconds duration = std::chrono::steady_clock::now() - start;
+        if (duration > handler_budget)
+            over_budget(current_call.name + current_call.kind, duration);
+    }
+
+#if LUA_VERSION_NUM >= 503
+    static int call_deferred_k(lua_State *L, int status, lua_KContext)
+    {
+        return call_deferred_continue(L, status);
+    }
+#else
+    static int call_deferred_k(lua_State *L)
+    {
+        int ctx;
+        int status = lua_getctx(L, &ctx);
+        return call_deferred_continue(L, status);
+    }
+#endif
+#endif
+
+    void print_error(const std::string& message)
+    {
+        errorf(_L, "%s", message.c_str());
+    }
+
+    void push_error(const std::string& message)
+    {
+        print_error(message.c_str());
+        if (!errors.empty())
+            errors += "\n---\n";
+        errors += message;
+    }
+
+    static int error_handler(lua_State *L)
+    {
+        lua_getglobal(L, "debug");
+        if (lua_istable(L, -1)) {
+            lua_getfield(L, -1, "traceback");
+            if (lua_isfunction(L, -1)) {
+                lua_pushvalue(L, -3); // original message
+                lua_pushinteger(L, 2); // don't show error_handler
+                if (lua_pcall(L, 2, 1, 0) == LUA_OK) {
+                    // stack: original error, debug, message
+                    lua_replace(L, -3);
+                } else {
+                    lua_pop(L, 1); // pop error
+                }
+            } else {
+                lua_pop(L, 1); // pop traceback
+            }
+        }
+        lua_pop(L, 1); // pop debug
+        return 1; // original error or traceback
+    }
+
+    bool add_pending_request(PendingRequest req, bool sent)
+    {
+        if (sent)
+            pending_requests[next_request_id++] = req;
+        else
+            unref(req.ref);
+        return sent;
+    }
+
+    /// Returns callback or thread for the reply and removes it from pending requests, or an invalid ref if none.
+    PendingRequest take_pending_request(const json& message)
+    {
+        if (pending_requests.empty())
+            return {};
+        const auto id_it = message.find(REQUEST_ID_KEY);
+        if (id_it == message.end() || !id_it->is_number_unsigned())
+            return {};
+        const auto it = pending_requests.find(id_it->get<uint64_t>());
+        if (it == pending_requests.end())
+            return {};
+        PendingRequest req = it->second;
+        pending_requests.erase(it);
+        return req;
+    }
+
+    /// Add new locations to the journal. Returns the locations that were added.
+    std::list<int64_t> add_to_check_journal(const std::list<int64_t>& locations)
+    {
+        std::list<int64_t> added;
+        for (int64_t location: locations) {
+            if (known_checked.insert(location).second) {
+                check_journal.push_back(location);
+                added.push_back(location);
+            }
+        }
+        return added;
+    }
+
+    /// Add new locations to the journal and file. Returns the number of locations that were added.
+    size_t journal_checks(const std::list<int64_t>& locations)
+    {
+        const std::list<int64_t> added = add_to_check_journal(locations);
+        if (added.empty())
+            return 0;
+        if (check_journal_file) {
+            if (!check_journal_header_written && !journal_seed.empty())
+                fprintf(check_journal_file, "# %d %d %s\n", journal_team, journal_slot, journal_seed.c_str());
+            check_journal_header_written = true;
+            for (int64_t location: added)
+                fprintf(check_journal_file, "%lld\n", (long long)location);
+            sync_check_journal();
+        }
+        // sync location tables
+        add_list("checked_locations", added, 1);
+        assign_set("missing_locations", get_missing_unjournaled(), 1);
+        return added.size();
+    }
+
+    /// Missing locations without the ones in the check journal
+    std::set<int64_t> get_missing_unjournaled() const
+    {
+        std::set<int64_t> missing = get_missing_locations();
+        for (int64_t location: check_journal)
+            missing.erase(location);
+        return missing;
+    }
+
+    void flush_check_journal()
+    {
+        if (check_journal.empty())
+            return;
+        std::list<int64_t> locations;
+        const auto& checked = get_checked_locations();
+        for (int64_t location: check_journal)
+            if (checked.find(location) == checked.end())
+                locations.push_back(location);
+
+        APClient* parent = this;
+        if (!locations.empty() && !parent->LocationChecks(locations))
+            return; // keep journal for the next connect
+
+        check_journal.clear();
+        truncate_check_journal();
+    }
+
+    /// Empty the journal file in place, so it stays open for the next checks
+    void truncate_check_journal()
+    {
+        if (!check_journal_file)
+            return;
+        fflush(check_journal_file);
+#ifdef _WIN32
+        const bool truncated = _chsize(_fileno(check_journal_file), 0) == 0;
+#else
+        const bool truncated = ftruncate(fileno(check_journal_file), 0) == 0;
+#endif
+        if (truncated) {
+            sync_check_journal();
+            check_journal_header_written = false;
+        } else { // sent checks stay in the file and are skipped as checked when restored
+            print_error("Could not truncate check journal " + check_journal_path);
+        }
+    }
+
+    /// Parse a check journal header "# team slot seed". Leaves the arguments unchanged if line is invalid.
+    static void parse_journal_header(const std::string& line, int& team, int& slot, std::string& seed)
+    {
+        try {
+            size_t pos = 1;
+            size_t len = 0;
+            const int header_team = std::stoi(line.substr(pos), &len);
+            pos += len;
+            const int header_slot = std::stoi(line.substr(pos), &len);
+            pos += len;
+            const size_t start = line.find_first_not_of(' ', pos);
+            if (start == std::string::npos || pos == start)
+                return;
+            team = header_team;
+            slot = header_slot;
+            seed = line.substr(start);
+        } catch (const std::exception&) {
+        }
+    }
+
+    void sync_check_journal()
+    {
+        fflush(check_journal_file);
+#ifdef _WIN32
+        _commit(_fileno(check_journal_file));
+#else
+        fsync(fileno(check_journal_file));
+#endif
+    }
+
+    void close_check_journal()
+    {
+        if (check_journal_file)
+            fclose(check_journal_file);
+        check_journal_file = nullptr;
+        check_journal_path.clear();
+    }
+
+    void clear_pending_requests()
+    {
+        // resuming may add new requests, so take them out first
+        std::map<uint64_t, PendingRequest> requests;
+        std::list<PendingScout> scouts;
+        requests.swap(pending_requests);
+        scouts.swap(pending_scouts);
+        for (auto& pair: requests) {
+            if (pair.second.is_thread)
+                resume_waiting("await", pair.second.ref, [](lua_State*) { return 0; });
+            else
+                unref(pair.second.ref);
+        }
+        for (auto& scout: scouts)
+            resume_waiting("await_scout", scout.thread, [](lua_State*) { return 0; });
+    }
+
+    /// Push reply command to Lua without the internal request ID
+    static void push_reply(lua_State *L, const json& message)
+    {
+        json_to_lua(L, message);
+        if (lua_istable(L, -1)) {
+            lua_pushnil(L);
+            lua_setfield(L, -2, REQUEST_ID_KEY);
+        }
+    }
+
+    /// Find the first pending scout that requested exactly the locations in items
+    std::list<PendingScout>::iterator find_pending_scout(const std::list<NetworkItem>& items)
+    {
+        if (pending_scouts.empty())
+            return pending_scouts.end();
+        std::set<int64_t> locations;
+        for (const auto& item: items)
+            locations.insert(item.location);
+        return std::find_if(pending_scouts.begin(), pending_scouts.end(), [&](const PendingScout& scout) {
+            return scout.locations == locations;
+        });
+    }
+
+    /// Resume coroutine waiting in an await_* call; push_args pushes the results onto its stack.
+    template <class F>
+    void resume_waiting(const char* name, LuaRef& thread_ref, F push_args)
+    {
+        if (!lua_checkstack(_L, 1))
+            throw std::runtime_error("Stack overflow");
+        lua_rawgeti(_L, LUA_REGISTRYINDEX, thread_ref.ref); // keep thread alive while resuming
+        unref(thread_ref);
+        lua_State *co = lua_tothread(_L, -1);
+        if (co && lua_status(co) == LUA_YIELD) {
+            int nres = 0;
+            int status = resume_thread(co, _L, push_args(co), &nres);
+            if (status == LUA_OK || status == LUA_YIELD) {
+                lua_pop(co, nres);
+            } else {
+                const char* err = lua_tostring(co, -1);
+                push_error(std::string("Error resuming ") + name + ":\n" + (err ? err : "<null>"));
+            }
+        }
+        lua_pop(_L, 1); // pop thread
+    }
+
+    void storage_update(const std::string& key, const json& value)
+    {
+        auto& entry = storage[key];
+        if (entry.version == 0 || entry.value != value) {
+            entry.value = value;
+            entry.version++;
+        }
+    }
+
+    void storage_resync()
+    {
+        APClient* parent = this;
+        if (!storage_notify_keys.empty()) {
+            parent->SetNotify({storage_notify_keys.begin(), storage_notify_keys.end()});
+        }
+        std::set<std::string> keys = storage_notify_keys;
+        for (const auto& pair: storage)
+            keys.insert(pair.first);
+        if (!keys.empty()) {
+            parent->Get({keys.begin(), keys.end()}, {{STORAGE_SYNC_KEY, true}});
+        }
+    }
+
+    /// Returns true and forgets nonce if it was sent by us
+    bool is_bounce_echo(const json& nonce)
+    {
+        if (!nonce.is_string())
+            return false;
+        const auto it = std::find(sent_bounces.begin(), sent_bounces.end(), nonce.get_ref<const std::string&>());
+        if (it == sent_bounces.end())
+            return false;
+        sent_bounces.erase(it);
+        return true;
+    }
+
+    template <class T>
+    void assign_set(const char* key, const std::set<T>& set, int table = -1)
+    {
+        // ensure stack space
+        if (!lua_checkstack(_L, 3))
             throw std::runtime_error("Stack overflow");
         // get table by name
         lua_getfield(_L, table, key);
@@ -789,11 +2553,88 @@ private:
     LuaRef print_cb;
     LuaRef print_json_cb;
     LuaRef bounced_cb;
+    std::map<std::string, LuaRef> bounced_tag_cbs;
     LuaRef retrieved_cb;
     LuaRef set_reply_cb;
     LuaRef checked_locations;
     LuaRef missing_locations;
     std::string errors;
+
+    struct StorageEntry {
+        json value;
+        uint64_t version = 0;
+    };
+
+    std::map<std::string, StorageEntry> storage;
+    std::set<std::string> storage_notify_keys;
+    std::string storage_seed;
+    int storage_team = -1;
+    int storage_slot = -1;
+
+    uint64_t next_request_id = 1;
+    std::map<uint64_t, PendingRequest> pending_requests;
+    std::list<PendingScout> pending_scouts;
+
+    std::map<std::string, std::string> data_package_checksums; // by game
+    size_t data_package_size = 0; // estimated, of the last data package
+
+    bool items_received_handler_set = false;
+    bool keep_item_log = false; // set by set_item_log_enabled and load_state
+    size_t received_count = 0; // items received since connecting to the slot
+    std::vector<NetworkItem> item_log; // received items by index
+    bool skip_logged_items = false; // set by load_state
+    std::string item_log_seed;
+    int item_log_team = -1;
+    int item_log_slot = -1;
+    std::set<int64_t> known_checked;
+    std::list<int64_t> check_journal; // checks made while not connected to a slot
+    FILE* check_journal_file = nullptr;
+    bool check_journal_header_written = false;
+    std::string journal_seed; // slot the journaled checks were made for, empty if unknown
+    int journal_team = -1;
+    int journal_slot = -1;
+    std::string check_journal_path;
+    FILE* capture_file = nullptr;
+    bool replaying = false; // internal handlers only call Lua handlers
+    bool replay_connection = false; // set by replay_connection_events
+    std::chrono::steady_clock::time_point capture_start;
+    bool stats_enabled = false;
+    std::map<std::string, HandlerStats> handler_stats;
+    Metrics metrics;
+    std::chrono::nanoseconds handler_budget{0};
+    LuaRef handler_budget_cb;
+    bool over_budget_reporting = false;
+    uint64_t budget_log_suppressed = 0;
+    std::chrono::steady_clock::time_point budget_log_next; // log at most every 10 seconds
+    std::vector<TraceSpan> trace; // ring buffer
+    size_t trace_capacity = 0;
+    size_t trace_next = 0;
+
+    static constexpr size_t MAX_SENT_BOUNCES = 16;
+    bool suppress_bounce_echo = false;
+    std::list<std::string> sent_bounces; // nonces
+
+    bool polling = false;
+    State last_state = State::DISCONNECTED;
+    std::chrono::steady_clock::time_point connect_start;
+    std::chrono::steady_clock::time_point native_poll_start;
+    ConnectionStats connection_stats;
+    bool socket_dropped = false;
+    ReconnectPolicy reconnect_policy;
+    uint64_t reconnect_attempts = 0; // since the last successful connect
+    std::chrono::steady_clock::time_point reconnect_at;
+    bool reconnect_gave_up = false;
+    std::mt19937 rng{std::random_device{}()};
+    bool queue_events = false;
+    bool native_polled = false;
+    std::string native_error;
+    std::list<std::function<void()>> events;
+#if LUA_VERSION_NUM >= 502
+    bool yieldable_handlers = false;
+    std::list<DeferredCall> deferred_calls;
+    DeferredCall current_call;
+    bool deferred_running = false; // until the last deferred call returned, including while yielded
+#endif
 };
 
 #if defined _MSC_VER && _MSC_VER < 1911
@@ -815,11 +2656,13 @@ static int apclient_new(lua_State *L)
     const char* uuid = luaL_checkstring(L, 1);
     const char* game = luaL_checkstring(L, 2);
     const char* host = luaL_checkstring(L, 3);
+    const char* cert_store = luaL_optstring(L, 4, nullptr);
 
     auto p = static_cast<LuaAPClient**>(lua_newuserdata(L, sizeof(LuaAPClient*)));
 
     try {
-        LuaAPClient *self = new LuaAPClient(L, uuid, game, host);
+        LuaAPClient *self = new LuaAPClient(L, uuid, game, host,
+                                            cert_store ? std::string(cert_store) : get_default_cert_store());
         *p = self;
         luaL_getmetatable(L, LuaAPClient::Lua_Name);
         lua_setmetatable(L, -2);
@@ -843,6 +2686,19 @@ static int apclient_call(lua_State *L)
     return apclient_new(L);
 }
 
+static int apclient_set_default_cert_store(lua_State *L)
+{
+    const char* path = luaL_optstring(L, 1, nullptr);
+    try {
+        set_default_cert_store(path ? path : "");
+        return 0;
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    lua_error(L);
+    return 0; // LCOV_EXCL_LINE // unreachable
+}
+
 static int apclient_del(lua_State *L)
 {
     debug(L, "APClient.__gc");
@@ -1003,11 +2859,11 @@ static int apclient_ConnectSlot(lua_State *L)
             }
         }
 
-        bool res;
-        if (version.ma > 0 || version.mi > 0 || version.build > 0)
-            res = self->ConnectSlot(slot, password, items_handling, tags, version);
-        else
-            res = self->ConnectSlot(slot, password, items_handling, tags);
+        bool res = self->traced("ConnectSlot", [&]() {
+            if (version.ma > 0 || version.mi > 0 || version.build > 0)
+                return self->ConnectSlot(slot, password, items_handling, tags, version);
+            return self->ConnectSlot(slot, password, items_handling, tags);
+        });
 
         lua_pushboolean(L, res);
         return 1;
@@ -1129,46 +2985,340 @@ static int apclient_get_players(lua_State *L)
     return 1;
 }
 
-static int apclient_get_permissions(lua_State *L)
+static int apclient_get_connection_stats(lua_State *L)
 {
     LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
-    json_to_lua(L, self->get_permissions());
+    const auto& stats = self->get_connection_stats();
+    json_to_lua(L, {
+        {"attempts", stats.attempts},
+        {"connects", stats.connects},
+        {"reconnects", stats.connects > 0 ? stats.connects - 1 : 0},
+        {"last_connect_time", stats.last_connect_time},
+        {"avg_connect_time", stats.connects > 0 ? stats.total_connect_time / (double)stats.connects : 0.0},
+    });
     return 1;
 }
 
-static int apclient_get_permission(lua_State *L)
+static int apclient_set_stats_enabled(lua_State *L)
 {
     LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
-    const char* key = luaL_checkstring(L, 2);
-    {
-        const APClient* parent = self;
-        const auto& perms = parent->get_permissions();
-        const auto it = perms.find(key);
-        if (it == perms.end()) {
-            lua_pushnil(L);
-        } else {
-            lua_pushinteger(L, static_cast<lua_Integer>(it->second));
+    self->set_stats_enabled(lua_toboolean(L, 2));
+    return 0;
+}
+
+static int apclient_get_stats(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    try {
+        auto seconds = [](std::chrono::nanoseconds t) {
+            return std::chrono::duration<double>(t).count();
+        };
+        json j = json::object();
+        for (const auto& pair: self->get_stats()) {
+            const auto& stats = pair.second;
+            json histogram = json::array();
+            double p99 = 0;
+            uint64_t count = 0;
+            for (size_t i = 0; i < LuaAPClient::HandlerStats::BUCKETS; i++) {
+                histogram.push_back(stats.histogram[i]);
+                count += stats.histogram[i];
+                if (p99 == 0 && stats.calls > 0 && count * 100 >= stats.calls * 99) {
+                    // upper bound of the bucket, but not above the slowest call
+                    p99 = std::min((double)(1LL << i) / 1e6, seconds(stats.max_time));
+                }
+            }
+            const auto total = stats.marshal_time + stats.lua_time;
+            j[pair.first] = {
+                {"calls", stats.calls},
+                {"errors", stats.errors},
+                {"over_budget", stats.over_budget},
+                {"marshal_time", seconds(stats.marshal_time)},
+                {"lua_time", seconds(stats.lua_time)},
+                {"min_time", stats.calls > 0 ? seconds(stats.min_time) : 0.0},
+                {"avg_time", stats.calls > 0 ? seconds(total) / (double)stats.calls : 0.0},
+                {"p99_time", p99},
+                {"max_time", seconds(stats.max_time)},
+                {"histogram", histogram},
+            };
         }
+        json_to_lua(L, j);
+        return 1;
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
     }
-    return 1;
+    lua_error(L);
+    return 0; // LCOV_EXCL_LINE // unreachable
 }
 
-static int apclient_set_socket_connected_handler(lua_State *L)
+static int apclient_get_metrics(lua_State *L)
 {
     LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
-    LuaRef ref;
-    lua_pushvalue(L, 2); // make copy on top of stack
-    ref.ref = luaL_ref(L, LUA_REGISTRYINDEX); // pop copy and store
-    self->set_socket_connected_handler(ref);
-    return 0;
+    try {
+        auto seconds = [](std::chrono::nanoseconds t) {
+            return std::chrono::duration<double>(t).count();
+        };
+        const auto& metrics = self->get_metrics();
+        json events = json::object();
+        for (const auto& pair: metrics.events)
+            events[pair.first] = pair.second;
+        json_to_lua(L, {
+            {"polls", metrics.polls},
+            {"poll_time", seconds(metrics.poll_time)},
+            {"max_poll_time", seconds(metrics.max_poll_time)},
+            {"native_time", seconds(metrics.native_time)},
+            {"event_time", seconds(metrics.event_time)},
+            {"events", events},
+            {"queues", self->get_queue_depths()},
+        });
+        return 1;
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    lua_error(L);
+    return 0; // LCOV_EXCL_LINE // unreachable
 }
 
-static int apclient_set_socket_error_handler(lua_State *L)
+static int apclient_get_memory_usage(lua_State *L)
 {
     LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
-    LuaRef ref;
-    lua_pushvalue(L, 2); // make copy on top of stack
-    ref.ref = luaL_ref(L, LUA_REGISTRYINDEX); // pop copy and store
+    try {
+        json_to_lua(L, self->get_memory_usage());
+        return 1;
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    lua_error(L);
+    return 0; // LCOV_EXCL_LINE // unreachable
+}
+
+static int apclient_set_handler_budget(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    lua_Number budget = luaL_optnumber(L, 2, 0);
+    if (!(budget >= 0 && budget <= 3600)) {
+        {
+            BadArgumentException ex(2, "0 <= seconds <= 3600", "set_handler_budget");
+            lua_pushstring(L, ex.what());
+        }
+        lua_error(L);
+        return 0; // LCOV_EXCL_LINE // unreachable
+    }
+    LuaRef ref;
+    if (!lua_isnoneornil(L, 3)) {
+        lua_pushvalue(L, 3); // make copy on top of stack
+        ref.ref = luaL_ref(L, LUA_REGISTRYINDEX); // pop copy and store
+    }
+    self->set_handler_budget(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::duration<double>(budget)), ref);
+    return 0;
+}
+
+static int apclient_set_tracing(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    lua_Integer capacity = luaL_optinteger(L, 2, 0);
+    if (capacity < 0 || capacity > 0x1000000) {
+        {
+            BadArgumentException ex(2, "0 <= integer <= 16777216", "set_tracing");
+            lua_pushstring(L, ex.what());
+        }
+        lua_error(L);
+        return 0; // LCOV_EXCL_LINE // unreachable
+    }
+    self->set_tracing((size_t)capacity);
+    return 0;
+}
+
+static int apclient_dump_trace(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    const char* path = luaL_checkstring(L, 2);
+    try {
+        lua_pushinteger(L, (lua_Integer)self->dump_trace(path));
+        return 1;
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    lua_error(L);
+    return 0; // LCOV_EXCL_LINE // unreachable
+}
+
+static int apclient_reset_stats(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    self->reset_stats();
+    return 0;
+}
+
+static int apclient_set_reconnect_policy(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    try {
+        LuaAPClient::ReconnectPolicy policy;
+        if (!lua_isnoneornil(L, 2)) {
+            policy.enabled = true;
+            double max_attempts = 0;
+            try {
+                json j = lua_to_json(L, 2);
+                if (j.is_object()) {
+                    policy.min_delay = j.value("min_delay", policy.min_delay);
+                    policy.max_delay = j.value("max_delay", std::max(policy.max_delay, policy.min_delay));
+                    policy.jitter = j.value("jitter", policy.jitter);
+                    max_attempts = j.value("max_attempts", max_attempts);
+                } else if (!j.is_array() || !j.empty()) {
+                    throw std::invalid_argument("not a table");
+                }
+            } catch (const std::exception&) {
+                throw BadArgumentException(2, "reconnect policy or nil", "set_reconnect_policy");
+            }
+            if (!(policy.min_delay >= 0) || !(policy.max_delay >= policy.min_delay) ||
+                    !(policy.jitter >= 0 && policy.jitter <= 1) || !(max_attempts >= 0)) {
+                throw BadArgumentException(2, "0 <= min_delay <= max_delay, 0 <= jitter <= 1, max_attempts >= 0",
+                                           "set_reconnect_policy");
+            }
+            policy.max_attempts = (uint64_t)max_attempts;
+        }
+        self->set_reconnect_policy(policy);
+        return 0;
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    lua_error(L);
+    return 0; // LCOV_EXCL_LINE // unreachable
+}
+
+static int apclient_set_check_journal(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    const char* path = luaL_optstring(L, 2, nullptr);
+    try {
+        self->set_check_journal(path ? path : "");
+        return 0;
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    lua_error(L);
+    return 0; // LCOV_EXCL_LINE // unreachable
+}
+
+static int apclient_get_check_journal_size(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    lua_pushinteger(L, (lua_Integer)self->get_check_journal_size());
+    return 1;
+}
+
+static int apclient_set_capture(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    const char* path = luaL_optstring(L, 2, nullptr);
+    try {
+        self->set_capture(path ? path : "");
+        return 0;
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    lua_error(L);
+    return 0; // LCOV_EXCL_LINE // unreachable
+}
+
+static int apclient_replay(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    const char* path = luaL_checkstring(L, 2);
+    bool realtime = lua_toboolean(L, 3);
+    try {
+        lua_pushinteger(L, (lua_Integer)self->replay(path, realtime));
+        return 1;
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    lua_error(L);
+    return 0; // LCOV_EXCL_LINE // unreachable
+}
+
+static int apclient_set_item_log_enabled(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    try {
+        self->set_item_log_enabled(lua_toboolean(L, 2));
+        return 0;
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    lua_error(L);
+    return 0; // LCOV_EXCL_LINE // unreachable
+}
+
+static int apclient_save_state(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    const char* path = luaL_checkstring(L, 2);
+    try {
+        self->save_state(path);
+        return 0;
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    lua_error(L);
+    return 0; // LCOV_EXCL_LINE // unreachable
+}
+
+static int apclient_load_state(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    const char* path = luaL_checkstring(L, 2);
+    try {
+        json j = self->load_state(path);
+        json_to_lua(L, j);
+        return 1;
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    lua_error(L);
+    return 0; // LCOV_EXCL_LINE // unreachable
+}
+
+static int apclient_get_permissions(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    json_to_lua(L, self->get_permissions());
+    return 1;
+}
+
+static int apclient_get_permission(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    const char* key = luaL_checkstring(L, 2);
+    {
+        const APClient* parent = self;
+        const auto& perms = parent->get_permissions();
+        const auto it = perms.find(key);
+        if (it == perms.end()) {
+            lua_pushnil(L);
+        } else {
+            lua_pushinteger(L, static_cast<lua_Integer>(it->second));
+        }
+    }
+    return 1;
+}
+
+static int apclient_set_socket_connected_handler(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    LuaRef ref;
+    lua_pushvalue(L, 2); // make copy on top of stack
+    ref.ref = luaL_ref(L, LUA_REGISTRYINDEX); // pop copy and store
+    self->set_socket_connected_handler(ref);
+    return 0;
+}
+
+static int apclient_set_socket_error_handler(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    LuaRef ref;
+    lua_pushvalue(L, 2); // make copy on top of stack
+    ref.ref = luaL_ref(L, LUA_REGISTRYINDEX); // pop copy and store
     self->set_socket_error_handler(ref);
     return 0;
 }
@@ -1283,6 +3433,35 @@ static int apclient_set_bounced_handler(lua_State *L)
     return 0;
 }
 
+static int apclient_set_bounced_tag_handler(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    const char* tag = luaL_checkstring(L, 2);
+    LuaRef ref;
+    if (!lua_isnoneornil(L, 3)) {
+        lua_pushvalue(L, 3); // make copy on top of stack
+        ref.ref = luaL_ref(L, LUA_REGISTRYINDEX); // pop copy and store
+    }
+    self->set_bounced_tag_handler(tag, ref);
+    return 0;
+}
+
+static int apclient_set_bounce_echo_suppression(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    luaL_checkany(L, 2);
+    self->set_bounce_echo_suppression(lua_toboolean(L, 2));
+    return 0;
+}
+
+static int apclient_set_yieldable_handlers(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    luaL_checkany(L, 2);
+    lua_pushboolean(L, self->set_yieldable_handlers(lua_toboolean(L, 2)));
+    return 1;
+}
+
 static int apclient_set_retrieved_handler(lua_State *L)
 {
     LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
@@ -1318,7 +3497,9 @@ static int apclient_ConnectUpdate(lua_State *L)
                 throw BadArgumentException(3, "items_handling or tags not nil", "ConnectUpdate");
             } else {
                 // update items_handling
-                lua_pushboolean(L, self->ConnectUpdate(true, items_handling, false, {}));
+                lua_pushboolean(L, self->traced("ConnectUpdate", [&]() {
+                    return self->ConnectUpdate(true, items_handling, false, {});
+                }));
             }
         } else {
             std::list<std::string> tags;
@@ -1332,10 +3513,14 @@ static int apclient_ConnectUpdate(lua_State *L)
 
             if (has_items_handling) {
                 // update both
-                lua_pushboolean(L, self->ConnectUpdate(true, items_handling, true, tags));
+                lua_pushboolean(L, self->traced("ConnectUpdate", [&]() {
+                    return self->ConnectUpdate(true, items_handling, true, tags);
+                }));
             } else {
                 // update tags
-                lua_pushboolean(L, self->ConnectUpdate(false, 0, true, tags));
+                lua_pushboolean(L, self->traced("ConnectUpdate", [&]() {
+                    return self->ConnectUpdate(false, 0, true, tags);
+                }));
             }
         }
 
@@ -1390,7 +3575,7 @@ static int apclient_Bounce(lua_State *L)
             }
         }
 
-        bool res = self->Bounce(data, games, slots, tags);
+        bool res = self->traced("Bounce", [&]() { return self->Bounce(data, games, slots, tags); });
         lua_pushboolean(L, res);
         return 1;
     } catch (const std::exception& ex) {
@@ -1404,21 +3589,22 @@ static int apclient_Say(lua_State *L)
 {
     LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
     const char* text = luaL_checkstring(L, 2);
-    lua_pushboolean(L, self->Say(text));
+    lua_pushboolean(L, self->traced("Say", [&]() { return self->Say(text); }));
     return 1;
 }
 
 static int apclient_Sync(lua_State *L)
 {
     LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
-    lua_pushboolean(L, self->Sync());
+    lua_pushboolean(L, self->traced("Sync", [&]() { return self->Sync(); }));
     return 1;
 }
 
 static int apclient_StatusUpdate(lua_State *L)
 {
     LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
-    lua_pushboolean(L, self->StatusUpdate(checkcint(L, 2)));
+    const int status = checkcint(L, 2);
+    lua_pushboolean(L, self->traced("StatusUpdate", [&]() { return self->StatusUpdate(status); }));
     return 1;
 }
 
@@ -1426,8 +3612,14 @@ static int apclient_LocationChecks(lua_State *L)
 {
     LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
     try {
-        lua_pushboolean(L, self->LocationChecks(lua_to_json(L, 2)));
-        return 1;
+        size_t sent, suppressed;
+        const json locations = lua_to_json(L, 2);
+        lua_pushboolean(L, self->traced("LocationChecks", [&]() {
+            return self->LocationChecks(locations, sent, suppressed);
+        }));
+        lua_pushinteger(L, (lua_Integer)sent);
+        lua_pushinteger(L, (lua_Integer)suppressed);
+        return 3;
     } catch (const std::exception& ex) {
         lua_pushstring(L, ex.what());
     }
@@ -1459,7 +3651,9 @@ static int apclient_LocationScouts(lua_State *L)
                 }
             }
         }
-        lua_pushboolean(L, self->LocationScouts(locations, create_as_hints));
+        lua_pushboolean(L, self->traced("LocationScouts", [&]() {
+            return self->LocationScouts(locations, create_as_hints);
+        }));
         return 1;
     } catch (const std::exception& ex) {
         lua_pushstring(L, ex.what());
@@ -1478,7 +3672,7 @@ static int apclient_UpdateHint(lua_State *L)
     const APClient::HintStatus status = static_cast<APClient::HintStatus>(checkcint(L, 4));
 
     try {
-        lua_pushboolean(L, self->UpdateHint(player, location, status));
+        lua_pushboolean(L, self->traced("UpdateHint", [&]() { return self->UpdateHint(player, location, status); }));
         return 1;
     } catch (const std::exception& ex) {
         lua_pushstring(L, ex.what());
@@ -1508,9 +3702,11 @@ static int apclient_CreateHints(lua_State *L)
             }
         }
         if (hasStatus) {
-            lua_pushboolean(L, self->CreateHints(locations, player, status));
+            lua_pushboolean(L, self->traced("CreateHints", [&]() {
+                return self->CreateHints(locations, player, status);
+            }));
         } else {
-            lua_pushboolean(L, self->CreateHints(locations, player));
+            lua_pushboolean(L, self->traced("CreateHints", [&]() { return self->CreateHints(locations, player); }));
         }
         return 1;
     } catch (const std::exception& ex) {
@@ -1520,16 +3716,34 @@ static int apclient_CreateHints(lua_State *L)
     return 0; // LCOV_EXCL_LINE // unreachable
 }
 
+/// Returns the index of an optional trailing callback argument at or after min_arg, or 0 if there is none
+static int opt_callback_arg(lua_State *L, int min_arg)
+{
+    int top = lua_gettop(L);
+    return (top >= min_arg && lua_isfunction(L, top)) ? top : 0;
+}
+
+static LuaRef ref_callback_arg(lua_State *L, int arg)
+{
+    LuaRef ref;
+    if (arg) {
+        lua_pushvalue(L, arg); // make copy on top of stack
+        ref.ref = luaL_ref(L, LUA_REGISTRYINDEX); // pop copy and store
+    }
+    return ref;
+}
+
 static int apclient_Get(lua_State *L)
 {
     LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
     try {
         json keys = lua_to_json(L, 2);
+        int cb_arg = opt_callback_arg(L, 3);
         json extra;
-        if (lua_gettop(L) >= 3)
+        if (lua_gettop(L) >= 3 && cb_arg != 3)
             extra = lua_to_json(L, 3);
 
-        bool res = self->Get(keys, extra);
+        bool res = self->traced("Get", [&]() { return self->Get(keys, extra, {ref_callback_arg(L, cb_arg)}); });
         lua_pushboolean(L, res);
         return 1;
     } catch (const std::exception& e) {
@@ -1543,7 +3757,8 @@ static int apclient_SetNotify(lua_State *L)
 {
     LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
     try {
-        lua_pushboolean(L, self->SetNotify(lua_to_json(L, 2)));
+        const json keys = lua_to_json(L, 2);
+        lua_pushboolean(L, self->traced("SetNotify", [&]() { return self->SetNotify(keys); }));
         return 1;
     } catch (const std::exception& ex) {
         lua_pushstring(L, ex.what());
@@ -1552,6 +3767,26 @@ static int apclient_SetNotify(lua_State *L)
     return 0; // LCOV_EXCL_LINE // unreachable
 }
 
+static int apclient_storage_get(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    const char* key = luaL_checkstring(L, 2);
+    try {
+        uint64_t version;
+        const json* value = self->storage_get(key, version);
+        if (value)
+            json_to_lua(L, *value);
+        else
+            lua_pushnil(L);
+        lua_pushinteger(L, static_cast<lua_Integer>(version));
+        return 2;
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    lua_error(L);
+    return 0; // LCOV_EXCL_LINE // unreachable
+}
+
 static int apclient_Set(lua_State *L)
 {
     LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
@@ -1568,12 +3803,15 @@ static int apclient_Set(lua_State *L)
             throw BadArgumentException(5, "array of operations", "Set");
         }
 
+        int cb_arg = opt_callback_arg(L, 6);
         json extras;
-        if (lua_gettop(L) >= 6) {
+        if (lua_gettop(L) >= 6 && cb_arg != 6) {
             extras = lua_to_json(L, 6);
         }
 
-        bool res = self->Set(key, dflt, want_reply, operations, extras);
+        bool res = self->traced("Set", [&]() {
+            return self->Set(key, dflt, want_reply, operations, extras, {ref_callback_arg(L, cb_arg)});
+        });
         lua_pushboolean(L, res);
         return 1;
     } catch (const std::exception& ex) {
@@ -1583,31 +3821,713 @@ static int apclient_Set(lua_State *L)
     return 0; // LCOV_EXCL_LINE // unreachable
 }
 
-static int apclient_poll(lua_State *L)
+/// Returns a ref to the running coroutine or throws if L is the main thread
+static LuaRef ref_running_thread(lua_State *L, const char* func)
 {
-    // run actual poll via pcall to avoid trashing any state
-    lua_pushcfunction(L, LuaAPClient::poll);
-    lua_pushvalue(L, -2);
-    if (lua_pcall(L, 1, 1, 0)) {
-        lua_error(L);
+    LuaRef ref;
+    // check before anything is sent, so no reply is routed to a thread that can not wait for it
+    if (lua_pushthread(L) == 1) {
+        // the main thread can never yield; this is the only check available on Lua 5.1/5.2
+        lua_pop(L, 1);
+        throw std::runtime_error(std::string(func) + " must be called from a coroutine");
     }
-    return 1;
+#if LUA_VERSION_NUM >= 503
+    if (!lua_isyieldable(L)) {
+        lua_pop(L, 1);
+        throw std::runtime_error(std::string(func) + " must be called from a yieldable coroutine");
+    }
+#endif
+    ref.ref = luaL_ref(L, LUA_REGISTRYINDEX); // pop thread and store
+    return ref;
 }
 
-// meta table ("class")
-
-#define SET_CFUNC(name) \
-    lua_pushcfunction(L, apclient_ ## name); \
-    lua_setfield(L, -2, #name);
-
-
-static int register_apclient(lua_State *L)
+static int apclient_await_get(lua_State *L)
 {
-    // register dependency types
-    LuaJson_EmptyArray::Lua_Register(L);
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    bool sent = false;
+    try {
+        json keys = lua_to_json(L, 2);
+        json extra;
+        if (lua_gettop(L) >= 3)
+            extra = lua_to_json(L, 3);
 
-    // register type/metatable for ctor and dtor
-    luaL_newmetatable(L, LuaAPClient::Lua_Name);
+        if (self->Get(keys, extra, {ref_running_thread(L, "await_get"), true})) {
+            sent = true;
+        } else {
+            lua_pushnil(L);
+            return 1;
+        }
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    if (!sent) {
+        lua_error(L);
+        return 0; // LCOV_EXCL_LINE // unreachable
+    }
+    // resumed with data, command from poll()
+    return lua_yield(L, 0);
+}
+
+static int apclient_await_set(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+    const char* key = luaL_checkstring(L, 2);
+    luaL_checkany(L, 3);
+    bool sent = false;
+    try {
+        json dflt = lua_to_json(L, 3);
+
+        std::list<APClient::DataStorageOperation> operations;
+        try {
+            lua_to_json(L, 4).get_to(operations);
+        } catch (const std::exception&) {
+            throw BadArgumentException(4, "array of operations", "await_set");
+        }
+
+        json extras;
+        if (lua_gettop(L) >= 5)
+            extras = lua_to_json(L, 5);
+
+        if (self->Set(key, dflt, true, operations, extras, {ref_running_thread(L, "await_set"), true})) {
+            sent = true;
+        } else {
+            lua_pushnil(L);
+            return 1;
+        }
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    if (!sent) {
+        lua_error(L);
+        return 0; // LCOV_EXCL_LINE // unreachable
+    }
+    // resumed with command from poll()
+    return lua_yield(L, 0);
+}
+
+static int apclient_await_scout(lua_State *L)
+{
+    LuaAPClient *self = LuaAPClient::luaL_checkthis(L, 1);
+
+    int create_as_hints = 0;
+    if (lua_gettop(L) >= 3) {
+        if (lua_isboolean(L, 3))
+            create_as_hints = lua_toboolean(L, 3) ? 1 : 0;
+        else
+            create_as_hints = (int)luaL_checkinteger(L, 3);
+    }
+
+    bool sent = false;
+    try {
+        std::list<int64_t> locations;
+        {
+            json j = lua_to_json(L, 2);
+            try {
+                locations = j.get<std::list<int64_t>>();
+            } catch (const std::exception&) {
+                if (!j.is_object() || !j.empty()) {
+                    throw BadArgumentException(2, "array of integer", "await_scout");
+                }
+            }
+        }
+        if (locations.empty()) {
+            // the server would not send anything to match
+            lua_newtable(L);
+            return 1;
+        }
+        if (self->await_scout(locations, create_as_hints, ref_running_thread(L, "await_scout"))) {
+            sent = true;
+        } else {
+            lua_pushnil(L);
+            return 1;
+        }
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    if (!sent) {
+        lua_error(L);
+        return 0; // LCOV_EXCL_LINE // unreachable
+    }
+    // resumed with items from poll()
+    return lua_yield(L, 0);
+}
+
+static int apclient_poll(lua_State *L)
+{
+    // run actual poll via pcall to avoid trashing any state
+    lua_pushcfunction(L, LuaAPClient::poll);
+    lua_pushvalue(L, -2);
+    if (lua_pcall(L, 1, 1, 0)) {
+        lua_error(L);
+    }
+#if LUA_VERSION_NUM >= 502
+    // run handlers that were deferred during poll, so they can yield
+    return LuaAPClient::call_deferred(L);
+#else
+    return 1;
+#endif
+}
+
+// group of clients that are polled together
+// NOTE: every APClient still owns its socket and asio context, this only saves the per-client calls from Lua
+
+/// Persistent worker threads that run a batch of jobs together with the calling thread
+class PollPool
+{
+public:
+    explicit PollPool(size_t threads)
+    {
+        for (size_t i = 0; i < threads; i++)
+            workers.emplace_back([this]() { run(); });
+    }
+
+    virtual ~PollPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        wake.notify_all();
+        for (auto& worker: workers)
+            worker.join();
+    }
+
+    size_t size() const
+    {
+        return workers.size();
+    }
+
+    /// Call job(i) for i in [0, count) spread over all threads. Returns when all jobs are done.
+    void run_all(size_t count, std::function<void(size_t)> job)
+    {
+        auto batch = std::make_shared<Batch>();
+        batch->job = std::move(job);
+        batch->count = count;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            current = batch;
+        }
+        wake.notify_all();
+        work(*batch);
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&]() { return batch->done == batch->count; });
+        current.reset();
+    }
+
+private:
+    struct Batch {
+        std::function<void(size_t)> job;
+        size_t count = 0;
+        std::atomic<size_t> next{0};
+        size_t done = 0; // guarded by mutex
+    };
+
+    void run()
+    {
+        std::shared_ptr<Batch> last;
+        for (;;) {
+            std::shared_ptr<Batch> batch;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&]() { return stop || (current && current != last); });
+                if (stop)
+                    return;
+                batch = last = current;
+            }
+            work(*batch);
+        }
+    }
+
+    void work(Batch& batch)
+    {
+        // threads that finish early take the next client
+        for (;;) {
+            size_t i = batch.next++;
+            if (i >= batch.count)
+                return;
+            batch.job(i);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (++batch.done == batch.count)
+                finished.notify_all();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    std::shared_ptr<Batch> current;
+    bool stop = false;
+};
+
+class LuaAPClientGroup
+{
+public:
+    LuaAPClientGroup(lua_State *L)
+        : _L(L)
+    {
+    }
+
+    virtual ~LuaAPClientGroup()
+    {
+        for (auto& pair: clients)
+            luaL_unref(_L, LUA_REGISTRYINDEX, pair.second.ref);
+    }
+
+    /// Add client at index arg of L's stack. Returns false if it already is in the group.
+    bool add(lua_State *L, LuaAPClient *client, int arg)
+    {
+        if (find(client) != clients.end())
+            return false;
+        LuaRef ref;
+        lua_pushvalue(L, arg); // make copy on top of stack
+        ref.ref = luaL_ref(L, LUA_REGISTRYINDEX); // pop copy and store
+        clients.push_back({client, ref});
+        return true;
+    }
+
+    /// Remove client. Returns false if it is not in the group.
+    bool remove(LuaAPClient *client)
+    {
+        auto it = find(client);
+        if (it == clients.end())
+            return false;
+        luaL_unref(_L, LUA_REGISTRYINDEX, it->second.ref);
+        clients.erase(it);
+        return true;
+    }
+
+    /// Set number of worker threads for the native part of poll. 0 polls everything on the Lua thread.
+    void set_worker_threads(size_t threads)
+    {
+        pool.reset();
+        if (threads > 0)
+            pool.reset(new PollPool(threads));
+    }
+
+    /// Poll all clients, even if some fail. Returns false and pushes the combined errors if any failed.
+    bool poll(lua_State *L)
+    {
+        // handlers may add or remove clients, so poll what is in the group now
+        int n = (int)clients.size();
+        if (!lua_checkstack(L, n + 2))
+            throw std::runtime_error("Stack overflow");
+        int base = lua_gettop(L);
+        std::vector<LuaAPClient*> polled;
+        polled.reserve(clients.size());
+        for (const auto& pair: clients) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, pair.second.ref);
+            polled.push_back(pair.first);
+        }
+
+        if (pool && n > 1) {
+            // sockets and parsing on all threads, handlers are then run from the Lua thread below
+            pool->run_all(polled.size(), [&polled](size_t i) {
+                polled[i]->poll_native();
+            });
+        }
+
+        std::string errors;
+        for (int i = 1; i <= n; i++) {
+            lua_pushcfunction(L, apclient_poll);
+            lua_pushvalue(L, base + i);
+            if (lua_pcall(L, 1, 0, 0)) {
+                const char* err = lua_tostring(L, -1);
+                if (!errors.empty())
+                    errors += "\n---\n";
+                errors += err ? err : "<null>";
+                lua_pop(L, 1); // pop error
+            }
+        }
+        lua_settop(L, base);
+
+        if (errors.empty())
+            return true;
+        lua_pushstring(L, errors.c_str());
+        return false;
+    }
+
+    size_t size() const
+    {
+        return clients.size();
+    }
+
+#if !defined _MSC_VER || _MSC_VER >= 1911
+    static constexpr char Lua_Name[] = "APClientGroup";
+#else
+    static char Lua_Name[]; // = "APClientGroup"; // assign this in implementation
+#endif
+
+    static LuaAPClientGroup* luaL_checkthis(lua_State *L, int narg)
+    {
+        return * (LuaAPClientGroup**)luaL_checkudata(L, narg, LuaAPClientGroup::Lua_Name);
+    }
+
+private:
+    typedef std::vector<std::pair<LuaAPClient*, LuaRef>> Clients;
+
+    Clients::iterator find(LuaAPClient *client)
+    {
+        return std::find_if(clients.begin(), clients.end(), [client](const Clients::value_type& pair) {
+            return pair.first == client;
+        });
+    }
+
+    lua_State *_L;
+    Clients clients;
+    std::unique_ptr<PollPool> pool;
+};
+
+#if defined _MSC_VER && _MSC_VER < 1911
+decltype(LuaAPClientGroup::Lua_Name) LuaAPClientGroup::Lua_Name = "APClientGroup";
+#elif __cplusplus < 201500L // c++14 needs a proper declaration
+decltype(LuaAPClientGroup::Lua_Name) constexpr LuaAPClientGroup::Lua_Name;
+#endif
+
+static int apclient_group(lua_State *L)
+{
+    auto p = static_cast<LuaAPClientGroup**>(lua_newuserdata(L, sizeof(LuaAPClientGroup*)));
+
+    try {
+        *p = new LuaAPClientGroup(L);
+        luaL_getmetatable(L, LuaAPClientGroup::Lua_Name);
+        lua_setmetatable(L, -2);
+        return 1;
+    } catch (const std::exception& ex) {
+        // NOTE: userdata will be freed by the GC since we don't return it
+        lua_pushstring(L, ex.what());
+    }
+    lua_error(L);
+    return 0; // LCOV_EXCL_LINE // unreachable
+}
+
+static int apclient_group_del(lua_State *L)
+{
+    LuaAPClientGroup *self = LuaAPClientGroup::luaL_checkthis(L, 1);
+    delete self;
+    return 0;
+}
+
+static int apclient_group_add(lua_State *L)
+{
+    LuaAPClientGroup *self = LuaAPClientGroup::luaL_checkthis(L, 1);
+    LuaAPClient *client = LuaAPClient::luaL_checkthis(L, 2);
+    lua_pushboolean(L, self->add(L, client, 2));
+    return 1;
+}
+
+static int apclient_group_remove(lua_State *L)
+{
+    LuaAPClientGroup *self = LuaAPClientGroup::luaL_checkthis(L, 1);
+    LuaAPClient *client = LuaAPClient::luaL_checkthis(L, 2);
+    lua_pushboolean(L, self->remove(client));
+    return 1;
+}
+
+static int apclient_group_size(lua_State *L)
+{
+    LuaAPClientGroup *self = LuaAPClientGroup::luaL_checkthis(L, 1);
+    lua_pushinteger(L, (lua_Integer)self->size());
+    return 1;
+}
+
+static int apclient_group_set_worker_threads(lua_State *L)
+{
+    LuaAPClientGroup *self = LuaAPClientGroup::luaL_checkthis(L, 1);
+    lua_Integer threads = luaL_checkinteger(L, 2);
+    if (threads < 0 || threads > 256) {
+        {
+            BadArgumentException ex(2, "0 <= integer <= 256", "set_worker_threads");
+            lua_pushstring(L, ex.what());
+        }
+        lua_error(L);
+        return 0; // LCOV_EXCL_LINE // unreachable
+    }
+    try {
+        self->set_worker_threads((size_t)threads);
+        return 0;
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    lua_error(L);
+    return 0; // LCOV_EXCL_LINE // unreachable
+}
+
+static int apclient_group_poll(lua_State *L)
+{
+    LuaAPClientGroup *self = LuaAPClientGroup::luaL_checkthis(L, 1);
+    bool ok = false;
+    try {
+        ok = self->poll(L);
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    if (!ok) {
+        lua_error(L);
+        return 0; // LCOV_EXCL_LINE // unreachable
+    }
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+// connection race for hosts without scheme
+// NOTE: address families are resolved inside wswrap, so only the schemes are raced
+
+class LuaAPClientRace
+{
+public:
+    LuaAPClientRace(lua_State *L, const std::string& uuid, const std::string& game, const std::string& host,
+                    double stagger, const std::string& certStore)
+        : _L(L), uuid(uuid), game(game), certStore(certStore), stagger(stagger),
+          start(std::chrono::steady_clock::now())
+    {
+        if (host.find("://") == std::string::npos) {
+            candidates[0].uri = "wss://" + host;
+            candidates[1].uri = "ws://" + host;
+        } else {
+            candidates[0].uri = host;
+        }
+    }
+
+    virtual ~LuaAPClientRace()
+    {
+        for (auto& candidate: candidates)
+            unref(candidate.client);
+        unref(winner);
+    }
+
+    /// Start and poll candidates. Returns true and pushes the winner once a candidate received RoomInfo.
+    bool poll(lua_State *L)
+    {
+        if (!lua_checkstack(L, 5))
+            throw std::runtime_error("Stack overflow");
+        if (winner.valid()) {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, winner.ref);
+            return true;
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        for (size_t i = 0; i < MAX_CANDIDATES; i++) {
+            auto& candidate = candidates[i];
+            if (candidate.uri.empty() || candidate.started || elapsed.count() < stagger * (double)i)
+                continue;
+            candidate.started = true;
+            lua_pushcfunction(L, apclient_new);
+            lua_pushstring(L, uuid.c_str());
+            lua_pushstring(L, game.c_str());
+            lua_pushstring(L, candidate.uri.c_str());
+            lua_pushstring(L, certStore.c_str());
+            if (lua_pcall(L, 4, 1, 0)) {
+                // a candidate that can not be created just loses
+                add_error(candidate, L);
+                continue;
+            }
+            candidate.client.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        }
+
+        bool running = false;
+        for (auto& candidate: candidates) {
+            if (!candidate.client.valid()) {
+                running = running || (!candidate.started && !candidate.uri.empty());
+                continue;
+            }
+            lua_pushcfunction(L, apclient_poll);
+            lua_rawgeti(L, LUA_REGISTRYINDEX, candidate.client.ref);
+            if (lua_pcall(L, 1, 0, 0)) {
+                // a broken candidate just loses
+                add_error(candidate, L);
+                close(L, candidate.client);
+                continue;
+            }
+            running = true;
+            lua_rawgeti(L, LUA_REGISTRYINDEX, candidate.client.ref);
+            LuaAPClient *client = LuaAPClient::luaL_checkthis(L, -1);
+            if (client->get_state() >= (int)APClient::State::ROOM_INFO) {
+                // keep the winner on the stack and drop the others
+                client->replay_connection_events();
+                winner = candidate.client;
+                candidate.client = {};
+                for (auto& other: candidates)
+                    close(L, other.client);
+                return true;
+            }
+            lua_pop(L, 1);
+        }
+        if (!running)
+            throw std::runtime_error("All connection attempts failed" + errors);
+        return false;
+    }
+
+#if !defined _MSC_VER || _MSC_VER >= 1911
+    static constexpr char Lua_Name[] = "APClientRace";
+#else
+    static char Lua_Name[]; // = "APClientRace"; // assign this in implementation
+#endif
+
+    static LuaAPClientRace* luaL_checkthis(lua_State *L, int narg)
+    {
+        return * (LuaAPClientRace**)luaL_checkudata(L, narg, LuaAPClientRace::Lua_Name);
+    }
+
+private:
+    struct Candidate {
+        std::string uri;
+        bool started = false;
+        LuaRef client;
+    };
+
+    void unref(LuaRef& ref)
+    {
+        if (ref.valid())
+            luaL_unref(_L, LUA_REGISTRYINDEX, ref.ref);
+        ref = {};
+    }
+
+    /// Close the connection of a losing candidate now instead of when it is collected, and drop it
+    void close(lua_State *L, LuaRef& ref)
+    {
+        if (!ref.valid())
+            return;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ref.ref);
+        LuaAPClient *client = LuaAPClient::luaL_checkthis(L, -1);
+        try {
+            // it is not polled anymore, so it does not reconnect
+            client->reset();
+        } catch (const std::exception&) {
+        }
+        lua_pop(L, 1);
+        unref(ref);
+    }
+
+    /// Pop the error of a failed candidate and remember it for when all candidates failed.
+    void add_error(const Candidate& candidate, lua_State *L)
+    {
+        const char* err = lua_tostring(L, -1);
+        errors += (errors.empty() ? ": " : "; ") + candidate.uri + ": " + (err ? err : "<null>");
+        lua_pop(L, 1);
+    }
+
+    static constexpr size_t MAX_CANDIDATES = 2;
+
+    lua_State *_L;
+    std::string uuid;
+    std::string game;
+    std::string certStore;
+    double stagger;
+    std::chrono::steady_clock::time_point start;
+    Candidate candidates[MAX_CANDIDATES]; // wss first, then ws after stagger
+    LuaRef winner;
+    std::string errors; // of failed candidates
+};
+
+#if defined _MSC_VER && _MSC_VER < 1911
+decltype(LuaAPClientRace::Lua_Name) LuaAPClientRace::Lua_Name = "APClientRace";
+#elif __cplusplus < 201500L // c++14 needs a proper declaration
+decltype(LuaAPClientRace::Lua_Name) constexpr LuaAPClientRace::Lua_Name;
+#endif
+
+static int apclient_race(lua_State *L)
+{
+    const char* uuid = luaL_checkstring(L, 1);
+    const char* game = luaL_checkstring(L, 2);
+    const char* host = luaL_checkstring(L, 3);
+    lua_Number stagger = luaL_optnumber(L, 4, 0.25);
+    const char* cert_store = luaL_optstring(L, 5, nullptr);
+
+    auto p = static_cast<LuaAPClientRace**>(lua_newuserdata(L, sizeof(LuaAPClientRace*)));
+
+    try {
+        *p = new LuaAPClientRace(L, uuid, game, host, (double)stagger,
+                                 cert_store ? std::string(cert_store) : get_default_cert_store());
+        luaL_getmetatable(L, LuaAPClientRace::Lua_Name);
+        lua_setmetatable(L, -2);
+        return 1;
+    } catch (const std::exception& ex) {
+        // NOTE: userdata will be freed by the GC since we don't return it
+        lua_pushstring(L, ex.what());
+    }
+    lua_error(L);
+    return 0; // LCOV_EXCL_LINE // unreachable
+}
+
+static int apclient_race_del(lua_State *L)
+{
+    LuaAPClientRace *self = LuaAPClientRace::luaL_checkthis(L, 1);
+    delete self;
+    return 0;
+}
+
+static int apclient_race_poll(lua_State *L)
+{
+    LuaAPClientRace *self = LuaAPClientRace::luaL_checkthis(L, 1);
+    try {
+        if (self->poll(L))
+            return 1;
+        lua_pushnil(L);
+        return 1;
+    } catch (const std::exception& ex) {
+        lua_pushstring(L, ex.what());
+    }
+    lua_error(L);
+    return 0; // LCOV_EXCL_LINE // unreachable
+}
+
+// meta table ("class")
+
+#define SET_CFUNC(name) \
+    lua_pushcfunction(L, apclient_ ## name); \
+    lua_setfield(L, -2, #name);
+
+
+#define SET_GROUP_CFUNC(name) \
+    lua_pushcfunction(L, apclient_group_ ## name); \
+    lua_setfield(L, -2, #name);
+
+
+static void register_apclient_group(lua_State *L)
+{
+    luaL_newmetatable(L, LuaAPClientGroup::Lua_Name);
+
+    lua_pushcfunction(L, apclient_group_del);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    SET_GROUP_CFUNC(add);
+    SET_GROUP_CFUNC(remove);
+    SET_GROUP_CFUNC(size);
+    SET_GROUP_CFUNC(poll);
+    SET_GROUP_CFUNC(set_worker_threads);
+
+    lua_pop(L, 1);
+}
+
+static void register_apclient_race(lua_State *L)
+{
+    luaL_newmetatable(L, LuaAPClientRace::Lua_Name);
+
+    lua_pushcfunction(L, apclient_race_del);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, apclient_race_poll);
+    lua_setfield(L, -2, "poll");
+
+    lua_pop(L, 1);
+}
+
+static int register_apclient(lua_State *L)
+{
+    // register dependency types
+    LuaJson_EmptyArray::Lua_Register(L);
+    register_apclient_group(L);
+    register_apclient_race(L);
+
+    // register type/metatable for ctor and dtor
+    luaL_newmetatable(L, LuaAPClient::Lua_Name);
 
     // special functions
     lua_pushcfunction(L, apclient_del);
@@ -1621,6 +4541,9 @@ static int register_apclient(lua_State *L)
 
     // functions
     SET_CFUNC(new);
+    SET_CFUNC(group);
+    SET_CFUNC(race);
+    SET_CFUNC(set_default_cert_store);
     SET_CFUNC(poll);
     SET_CFUNC(reset);
     SET_CFUNC(get_player_alias);
@@ -1643,7 +4566,25 @@ static int register_apclient(lua_State *L)
     SET_CFUNC(get_server_time);
     SET_CFUNC(get_players);
     SET_CFUNC(get_permissions);
+    SET_CFUNC(get_connection_stats);
+    SET_CFUNC(set_reconnect_policy);
+    SET_CFUNC(set_stats_enabled);
+    SET_CFUNC(get_stats);
+    SET_CFUNC(reset_stats);
+    SET_CFUNC(get_metrics);
+    SET_CFUNC(set_handler_budget);
+    SET_CFUNC(get_memory_usage);
+    SET_CFUNC(set_tracing);
+    SET_CFUNC(dump_trace);
+    SET_CFUNC(set_item_log_enabled);
+    SET_CFUNC(save_state);
+    SET_CFUNC(load_state);
+    SET_CFUNC(set_check_journal);
+    SET_CFUNC(get_check_journal_size);
+    SET_CFUNC(set_capture);
+    SET_CFUNC(replay);
     SET_CFUNC(get_permission);
+    SET_CFUNC(storage_get);
 
     // handlers
     SET_CFUNC(set_socket_connected_handler);
@@ -1659,8 +4600,11 @@ static int register_apclient(lua_State *L)
     SET_CFUNC(set_print_handler);
     SET_CFUNC(set_print_json_handler);
     SET_CFUNC(set_bounced_handler);
+    SET_CFUNC(set_bounced_tag_handler);
+    SET_CFUNC(set_bounce_echo_suppression);
     SET_CFUNC(set_retrieved_handler);
     SET_CFUNC(set_set_reply_handler);
+    SET_CFUNC(set_yieldable_handlers);
 
     // commands
     SET_CFUNC(Say);
@@ -1677,6 +4621,11 @@ static int register_apclient(lua_State *L)
     SET_CFUNC(SetNotify);
     SET_CFUNC(Set);
 
+    // coroutine commands
+    SET_CFUNC(await_get);
+    SET_CFUNC(await_set);
+    SET_CFUNC(await_scout);
+
     // enums
     json_to_lua(L, {
         {"UNKNOWN", LuaAPClient::ClientStatus::UNKNOWN},
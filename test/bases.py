@@ -1,3 +1,5 @@
+import os
+import tempfile
 from typing import Any, Dict, List, cast
 from unittest import TestCase
 
@@ -98,8 +100,18 @@ class ClientTestCase(LuaTestCase):
     def on_set_reply(self, command: LuaTable) -> None:
         pass
 
+    def create_client(self) -> LuaTable:
+        return self.apclient(self.uuid, self.game, self.uri)
+
+    def temp_path(self, name: str) -> str:
+        """Returns a path inside a temporary directory that is removed after the test"""
+        if not hasattr(self, "_tmp"):
+            self._tmp = tempfile.TemporaryDirectory()
+            self.addCleanup(self._tmp.cleanup)
+        return os.path.join(self._tmp.name, name)
+
     def connect(self) -> None:
-        self.client = self.apclient(self.uuid, self.game, self.uri)
+        self.client = self.create_client()
         self.call("set_socket_connected_handler", self.on_socket_connected)
         self.call("set_socket_error_handler", self.on_socket_error)
         self.call("set_socket_disconnected_handler", self.on_socket_disconnected)
@@ -143,6 +155,7 @@ class E2ETestCase(ClientTestCase):
     socket_connected = False
     got_room_info = False
     slot_connected = False
+    got_items = False
 
     def poll(self) -> None:
         self.server.check()
@@ -156,6 +169,12 @@ class E2ETestCase(ClientTestCase):
         for _ in TimeoutLoop(lambda: not self.slot_connected):
             self.poll()
 
+    def sync(self) -> None:
+        self.got_items = False
+        self.call("Sync")
+        for _ in TimeoutLoop(lambda: not self.got_items):
+            self.poll()
+
     def on_socket_connected(self) -> None:
         self.socket_connected = True
 
@@ -167,6 +186,9 @@ class E2ETestCase(ClientTestCase):
         print("on_slot_connected")
         self.slot_connected = True
 
+    def on_items_received(self, items: LuaTable) -> None:
+        self.got_items = True
+
     def _connect_slot(self) -> None:
         self.call(
             "ConnectSlot",
@@ -60,6 +60,7 @@ class APServer(WSServer):
     _connections: List[Connection]
     _exception: Optional[Exception] = None
     password: Optional[str] = None
+    seed_name = "seed"
     player_names = ["Player1"]
     player_games = ["Game"]
     player_start_items: List[List[Dict[str, Any]]] = [
@@ -228,7 +229,7 @@ class APServer(WSServer):
     def send_room_info(self, conn: ServerConnection) -> None:
         conn.send(json.dumps([{
             "cmd": "RoomInfo",
-            "seed_name": "seed",
+            "seed_name": self.seed_name,
             "time": time.time(),
             "version": {"major": 0, "minor": 6, "build": 3, "class": "Version"},
             "tags": ["Test"],
@@ -0,0 +1,77 @@
+import os
+
+from .bases import E2ETestCase
+from .util import LuaError, LuaTable
+
+
+class TestCapture(E2ETestCase):
+    reconnecting = False
+
+    def setUp(self) -> None:
+        self.path = self.temp_path("capture.bin")
+        super().setUp()
+
+    def on_room_info(self) -> None:
+        super().on_room_info()
+        if self.reconnecting:
+            self._connect_slot()
+
+    def test_replay(self) -> None:
+        self.call("set_capture", self.path)
+        self.sync()
+        self.call("set_capture", None)
+
+        replayed = []
+        client = self.create_client()
+        client["set_items_received_handler"](client, lambda items: replayed.append(items[1]["item"]))
+        count = client["replay"](client, self.path)
+        self.assertEqual(count, 1)
+        self.assertEqual(replayed, [1])
+        del client
+        self.lua.gccollect()
+
+    def test_replay_keeps_state(self) -> None:
+        # record a slot connect, which normally flushes the check journal
+        self.call("set_capture", self.path)
+        self.reconnecting = True
+        self.slot_connected = False
+        self.call("reset")
+        self.wait_slot_connected()
+        self.call("set_capture", None)
+
+        journal = self.temp_path("checks.txt")
+        connected = []
+        client = self.create_client()
+        client["set_check_journal"](client, journal)
+        client["LocationChecks"](client, self.lua.table(1))
+        client["set_slot_connected_handler"](client, lambda slot_data: connected.append(True))
+        client["replay"](client, self.path)
+        self.assertEqual(connected, [True])
+        self.assertEqual(client["get_check_journal_size"](client), 1)
+        self.assertTableEqualList(client["checked_locations"], [1])
+        with open(journal, encoding="utf-8") as f:
+            self.assertEqual(f.read().split(), ["1"])
+        del client
+        self.lua.gccollect()
+
+    def test_replay_error(self) -> None:
+        self.call("set_capture", self.path)
+        self.sync()
+        self.call("set_capture", None)
+
+        def on_items_received(items: LuaTable) -> None:
+            raise RuntimeError("OK")
+
+        self.call("set_items_received_handler", on_items_received)
+        with self.assertRaises(LuaError):
+            self.call("replay", self.path)
+
+    def test_bad_file(self) -> None:
+        with open(self.path, "wb") as f:
+            f.write(b"APCS")
+        with self.assertRaises(LuaError):
+            self.call("replay", self.path)
+        with self.assertRaises(LuaError):
+            self.call("replay", self.temp_path("missing.bin"))
+        with self.assertRaises(LuaError):
+            self.call("set_capture", self.temp_path(os.path.join("missing", "capture.bin")))
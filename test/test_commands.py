@@ -1,7 +1,10 @@
+import os
+import tempfile
 from typing import Any, Dict, List, Optional, cast
+from unittest import skipIf
 
 from .bases import E2ETestCase, NotConnectedTestCase
-from .util import LuaError, LuaTable, TimeoutLoop
+from .util import LuaError, LuaTable, TimeoutLoop, is_jit, lua_version
 
 
 class TestSay(E2ETestCase):
@@ -114,6 +117,91 @@ class TestBounce(E2ETestCase):
             self.client["Bounce"](self.lua.table())
 
 
+class TestBounceTagHandler(E2ETestCase):
+    done = False
+    nonce = "ok"
+
+    def on_bounced(self, command: LuaTable) -> None:
+        raise RuntimeError("Expected bounce to be routed to tag handler")
+
+    def on_tag_bounced(self, data: LuaTable) -> None:
+        if data["nonce"] != self.nonce:
+            raise RuntimeError("Bad bounce")
+        self.done = True
+
+    def bounce(self) -> None:
+        ok = self.call(
+            "Bounce",
+            self.lua.table(nonce = self.nonce),
+            None,
+            None,
+            self.lua.table("Test"),
+        )
+        self.assertTrue(ok)
+
+    def test_tag(self) -> None:
+        self.call("set_bounced_tag_handler", "Test", self.on_tag_bounced)
+        self.bounce()
+        for _ in TimeoutLoop(lambda: not self.done):
+            self.poll()
+
+    def test_unset(self) -> None:
+        self.call("set_bounced_tag_handler", "Test", self.on_tag_bounced)
+        self.call("set_bounced_tag_handler", "Test", None)
+        self.call("set_bounced_handler", lambda command: self.on_tag_bounced(command["data"]))
+        self.bounce()
+        for _ in TimeoutLoop(lambda: not self.done):
+            self.poll()
+
+    def test_echo_suppression(self) -> None:
+        nonces = []
+        synced = []
+        self.call("set_bounced_tag_handler", "Test", lambda data: nonces.append(data["nonce"]))
+        self.call("set_items_received_handler", lambda items: synced.append(True))
+        self.call("set_bounce_echo_suppression", True)
+        self.bounce()
+        # the reply to Sync is sent after the echo
+        self.assertTrue(self.call("Sync"))
+        for _ in TimeoutLoop(lambda: not synced):
+            self.poll()
+        # a bounce from someone else still arrives
+        self.server.send_bounce([], [], ["Test"], {"nonce": "other"})
+        for _ in TimeoutLoop(lambda: not nonces):
+            self.poll()
+        self.assertEqual(nonces, ["other"])
+
+    def test_echo_suppression_same_data(self) -> None:
+        other = self.create_client()
+        state = self.apclient["State"]
+        for _ in TimeoutLoop(lambda: other["get_state"](other) < state["ROOM_INFO"]):
+            other["poll"](other)
+        other["ConnectSlot"](other, self.slot, "", self.items_handling, self.lua.table("Test"), self.lua.table(0, 6, 3))
+        for _ in TimeoutLoop(lambda: other["get_state"](other) < state["SLOT_CONNECTED"]):
+            other["poll"](other)
+
+        nonces = []
+        synced = []
+        self.call("set_bounced_tag_handler", "Test", lambda data: nonces.append(data["nonce"]))
+        self.call("set_items_received_handler", lambda items: synced.append(True))
+        self.call("set_bounce_echo_suppression", True)
+        self.bounce()
+        self.assertTrue(other["Bounce"](other, self.lua.table(nonce=self.nonce), None, None, self.lua.table("Test")))
+        other["poll"](other)
+        for _ in TimeoutLoop(lambda: not nonces):
+            self.poll()
+        # the reply to Sync is sent after our own echo
+        self.assertTrue(self.call("Sync"))
+        for _ in TimeoutLoop(lambda: not synced):
+            self.poll()
+        self.assertEqual(nonces, [self.nonce])
+        del other
+        self.lua.gccollect()
+
+    def test_bad_tag(self) -> None:
+        with self.assertRaises(LuaError):
+            self.call("set_bounced_tag_handler", self.lua.table(), self.on_tag_bounced)
+
+
 class TestBounceNotConnected(NotConnectedTestCase):
     def test_call(self) -> None:
         res = self.call("Bounce")
@@ -224,17 +312,30 @@ class TestLocationChecks(E2ETestCase):
     def on_location_checked(self, locations: LuaTable) -> None:
         # own location should be filtered out
         # TODO: test receiveOwnLocations once we update apclientpp
-        # TODO: also test duplicates
         if self.started:
             self.fail("Unexpected location checked")
 
     def test_location_checks(self) -> None:
         self.started = True
-        res = self.call("LocationChecks", self.lua.table(self.location_id))
+        res, sent, suppressed = self.call("LocationChecks", self.lua.table(self.location_id))
         self.assertTrue(res)
+        self.assertEqual(sent, 1)
+        self.assertEqual(suppressed, 0)
         for _ in TimeoutLoop(lambda: not self.done):
             self.poll()
 
+    def test_duplicates(self) -> None:
+        self.started = True
+        res, sent, suppressed = self.call("LocationChecks", self.lua.table(self.location_id, self.location_id))
+        self.assertTrue(res)
+        self.assertEqual(sent, 1)
+        self.assertEqual(suppressed, 1)
+        res, sent, suppressed = self.call("LocationChecks", self.lua.table(self.location_id))
+        self.assertTrue(res)
+        self.assertEqual(sent, 0)
+        self.assertEqual(suppressed, 1)
+        self.assertTableEqualList(self.client["checked_locations"], [self.location_id])
+
     def test_bad_self(self) -> None:
         with self.assertRaises(LuaError):
             self.client["LocationChecks"](self.lua.table())
@@ -244,12 +345,106 @@ class TestLocationChecks(E2ETestCase):
             self.call("LocationChecks", 1)
 
 
+class TestLocationChecksJournal(E2ETestCase):
+    reconnecting = False
+    done = False
+    location_id = 2**32
+
+    def on_room_info(self) -> None:
+        super().on_room_info()
+        if self.reconnecting:
+            self._connect_slot()
+
+    def on_items_received(self, items: LuaTable) -> None:
+        if self.reconnecting and items[1]["location"] == self.location_id:
+            self.done = True
+
+    def test_flush(self) -> None:
+        self.reconnecting = True
+        self.call("reset")
+        res = self.call("LocationChecks", self.lua.table(self.location_id))
+        self.assertTrue(res)
+        self.assertEqual(self.call("get_check_journal_size"), 1)
+        for _ in TimeoutLoop(lambda: not self.done, timeout=5):
+            self.poll()
+        self.assertEqual(self.call("get_check_journal_size"), 0)
+
+    def test_header(self) -> None:
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, "checks.txt")
+            self.call("set_check_journal", path)
+            self.reconnecting = True
+            self.call("reset")
+            self.call("LocationChecks", self.lua.table(self.location_id))
+            with open(path) as f:
+                self.assertEqual(f.read(), f"# 0 1 seed\n{self.location_id}\n")
+            for _ in TimeoutLoop(lambda: not self.done, timeout=5):
+                self.poll()
+            self.call("set_check_journal", None)
+
+    def test_different_slot(self) -> None:
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, "checks.txt")
+            with open(path, "w") as f:
+                f.write(f"# 0 1 other\n{self.location_id}\n")
+            self.reconnecting = True
+            self.slot_connected = False
+            self.call("reset")
+            self.call("set_check_journal", path)
+            self.assertEqual(self.call("get_check_journal_size"), 1)
+            self.wait_slot_connected()
+            self.assertEqual(self.call("get_check_journal_size"), 0)
+            # the server saw everything sent before the bounce
+            bounced = []
+            self.call("set_bounced_handler", lambda command: bounced.append(True))
+            self.call("Bounce", self.lua.table(), None, self.lua.table(self.call("get_player_number")), None)
+            for _ in TimeoutLoop(lambda: not bounced):
+                self.poll()
+            self.assertFalse(self.done)
+            self.assertNotIn(self.location_id, [item["location"] for item in self.server.player_items[0]])
+            self.call("set_check_journal", None)
+            with open(path) as f:
+                self.assertEqual(f.read(), "")
+
+
 class TestLocationChecksNotConnected(NotConnectedTestCase):
     def test_call(self) -> None:
-        # This will queue up the checks
-        res = self.call("LocationChecks", self.lua.table(1))
+        # This will journal the checks
+        res, sent, suppressed = self.call("LocationChecks", self.lua.table(1))
         self.assertTrue(res)
-        # TODO: test if polling afterwards actually does the checks
+        self.assertEqual(sent, 1)
+        res, sent, suppressed = self.call("LocationChecks", self.lua.table(1, 2))
+        self.assertTrue(res)
+        self.assertEqual(sent, 1)
+        self.assertEqual(suppressed, 1)
+        self.assertEqual(self.call("get_check_journal_size"), 2)
+        self.assertTableEqualList(self.client["checked_locations"], [1, 2])
+
+    def test_missing_synced(self) -> None:
+        missing_locations = self.client["missing_locations"]
+        missing_locations[1] = 1
+        self.call("LocationChecks", self.lua.table(1))
+        self.assertTableEqualList(self.client["checked_locations"], [1])
+        self.assertTableEqualList(self.client["missing_locations"], [])
+
+    def test_journal_file(self) -> None:
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, "checks.txt")
+            self.call("set_check_journal", path)
+            self.call("LocationChecks", self.lua.table(1, 2))
+            self.call("set_check_journal", None)
+            with open(path) as f:
+                self.assertEqual(f.read(), "1\n2\n")
+            client = self.create_client()
+            client["set_check_journal"](client, path)
+            self.assertEqual(client["get_check_journal_size"](client), 2)
+            self.assertTableEqualList(client["checked_locations"], [1, 2])
+            del client
+            self.lua.gccollect()
+
+    def test_bad_journal(self) -> None:
+        with self.assertRaises(LuaError):
+            self.call("set_check_journal", os.path.join("does", "not", "exist", "checks.txt"))
 
 
 class TestLocationScout(E2ETestCase):
@@ -463,6 +658,35 @@ class TestGet(E2ETestCase):
             self.poll()
         self.assertEqual(self.received_extra, self.extra)
 
+    def test_get_callback(self) -> None:
+        def callback(data: LuaTable, command: LuaTable) -> None:
+            self.on_retrieved(data, self.lua.table(*self.data.keys()), command)
+
+        self.call("set_retrieved_handler", lambda *args: self.fail("Unexpected call to retrieved handler"))
+        res = self.call("Get", self.lua.table(*self.data.keys()), self.lua.table(**self.extra), callback)
+        self.assertTrue(res)
+        for _ in TimeoutLoop(lambda: not self.done):
+            self.poll()
+        self.assertEqual(self.received_extra, self.extra)
+
+    def test_get_callback_no_extra(self) -> None:
+        def callback(data: LuaTable, command: LuaTable) -> None:
+            self.on_retrieved(data, self.lua.table(*self.data.keys()), command)
+
+        res = self.call("Get", self.lua.table(*self.data.keys()), callback)
+        self.assertTrue(res)
+        for _ in TimeoutLoop(lambda: not self.done):
+            self.poll()
+        self.assertFalse(self.received_extra)
+
+    def test_get_stale_id(self) -> None:
+        # a reply for a request that is no longer pending still gets its internal ID removed
+        res = self.call("Get", self.lua.table(*self.data.keys()), self.lua.table(_lua_apclientpp_id=12345))
+        self.assertTrue(res)
+        for _ in TimeoutLoop(lambda: not self.done):
+            self.poll()
+        self.assertFalse(self.received_extra)
+
     def test_bad_self(self) -> None:
         with self.assertRaises(LuaError):
             self.client["Get"](self.lua.table())
@@ -637,6 +861,55 @@ class TestSet(E2ETestCase):
             self.poll()
         self.assertEqual(self.received_extra, self.extra)
 
+    def test_stale_id(self) -> None:
+        # a reply for a request that is no longer pending still gets its internal ID removed
+        res = self.call(
+            "Set",
+            "a",
+            1,
+            True,
+            self.apclient["EMPTY_ARRAY"],
+            self.lua.table(_lua_apclientpp_id=12345),
+        )
+        self.assertTrue(res)
+        for _ in TimeoutLoop(lambda: not self.done):
+            self.poll()
+        self.assertFalse(self.received_extra)
+
+    def test_callback(self) -> None:
+        value = 1
+        self.call("set_set_reply_handler", lambda command: self.fail("Unexpected call to set_reply handler"))
+        res = self.call(
+            "Set",
+            "a",
+            value,
+            False,
+            self.apclient["EMPTY_ARRAY"],
+            self.data_as_table(self.extra),
+            self.on_set_reply,
+        )
+        self.assertTrue(res)
+        for _ in TimeoutLoop(lambda: not self.done):
+            self.poll()
+        self.assertEqual(self.received_value, value)
+        self.assertEqual(self.received_extra, self.extra)
+
+    def test_callback_no_extra(self) -> None:
+        value = 1
+        res = self.call(
+            "Set",
+            "a",
+            value,
+            False,
+            self.apclient["EMPTY_ARRAY"],
+            self.on_set_reply,
+        )
+        self.assertTrue(res)
+        for _ in TimeoutLoop(lambda: not self.done):
+            self.poll()
+        self.assertEqual(self.received_value, value)
+        self.assertFalse(self.received_extra)
+
     def test_empty_array(self) -> None:
         key = "a"
         res = self.call(
@@ -753,6 +1026,158 @@ class TestSetNotify(E2ETestCase):
             )
 
 
+class TestStorageMirror(E2ETestCase):
+    done = False
+    reconnecting = False
+
+    def on_room_info(self) -> None:
+        super().on_room_info()
+        if self.reconnecting:
+            self._connect_slot()
+
+    def on_retrieved(self, data: LuaTable, keys: LuaTable, command: LuaTable) -> None:
+        self.done = True
+
+    def on_set_reply(self, command: LuaTable) -> None:
+        self.done = True
+
+    def test_unknown(self) -> None:
+        value, version = self.call("storage_get", "unknown")
+        self.assertIsNone(value)
+        self.assertEqual(version, 0)
+
+    def test_get(self) -> None:
+        self.server.data_storage = {"a": 1}
+        res = self.call("Get", self.lua.table("a"))
+        self.assertTrue(res)
+        for _ in TimeoutLoop(lambda: not self.done):
+            self.poll()
+        value, version = self.call("storage_get", "a")
+        self.assertEqual(value, 1)
+        self.assertEqual(version, 1)
+
+    def test_set(self) -> None:
+        # setting the same value again should not bump the version
+        for value, expected_version in ((1, 1), (1, 1), (2, 2)):
+            self.done = False
+            res = self.call("Set", "a", value, True, self.lua.table(self.lua.table("replace", value)))
+            self.assertTrue(res)
+            for _ in TimeoutLoop(lambda: not self.done):
+                self.poll()
+            stored_value, version = self.call("storage_get", "a")
+            self.assertEqual(stored_value, value)
+            self.assertEqual(version, expected_version)
+
+    def test_reset(self) -> None:
+        res = self.call("Set", "a", 1, True, self.lua.table(self.lua.table("replace", 1)))
+        self.assertTrue(res)
+        for _ in TimeoutLoop(lambda: not self.done):
+            self.poll()
+        self.assertEqual(self.call("storage_get", "a")[1], 1)
+        self.call("reset")
+        value, version = self.call("storage_get", "a")
+        self.assertIsNone(value)
+        self.assertEqual(version, 0)
+
+    def test_slot_change(self) -> None:
+        self.server.data_storage = {"a": 1}
+        self.assertTrue(self.call("SetNotify", self.lua.table("a")))
+        self.assertTrue(self.call("Get", self.lua.table("a")))
+        for _ in TimeoutLoop(lambda: not self.done):
+            self.poll()
+        self.assertEqual(self.call("storage_get", "a")[1], 1)
+        # reconnect to a different room
+        self.server.seed_name = "other"
+        self.reconnecting = True
+        self.slot_connected = False
+        self.server._connections[0].connection.close()
+        for _ in TimeoutLoop(lambda: not self.slot_connected, timeout=5):
+            self.poll()
+        # the reply to Sync is sent after the reply to a resync of the mirror
+        synced = []
+        self.call("set_items_received_handler", lambda items: synced.append(True))
+        self.assertTrue(self.call("Sync"))
+        for _ in TimeoutLoop(lambda: not synced):
+            self.poll()
+        value, version = self.call("storage_get", "a")
+        self.assertIsNone(value)
+        self.assertEqual(version, 0)
+
+    def test_bad_key(self) -> None:
+        with self.assertRaises(LuaError):
+            self.call("storage_get", self.lua.table())
+
+
+class TestAwait(E2ETestCase):
+    location_id = 2**32
+
+    def run_coroutine(self, code: str) -> LuaTable:
+        result = self.lua.table()
+        co = self.lua.eval(f"function(client, result) return coroutine.create(function() {code} end) end")(
+            self.client, result
+        )
+        ok, err = self.lua.eval("function(co) local ok, err = coroutine.resume(co); return ok, tostring(err) end")(co)
+        self.assertTrue(ok, err)
+        for _ in TimeoutLoop(lambda: self.lua.eval("coroutine.status")(co) != "dead"):
+            self.poll()
+        return result
+
+    def test_await_get(self) -> None:
+        self.server.data_storage = {"a": 1}
+        result = self.run_coroutine("local data, cmd = client:await_get({'a'}); result.value = data.a; result.cmd = cmd.cmd")
+        self.assertEqual(result["value"], 1)
+        self.assertEqual(result["cmd"], "Retrieved")
+
+    def test_await_set(self) -> None:
+        result = self.run_coroutine("local cmd = client:await_set('a', 0, {{'replace', 2}}); result.value = cmd.value")
+        self.assertEqual(result["value"], 2)
+
+    def test_await_scout(self) -> None:
+        result = self.run_coroutine(f"local items = client:await_scout({{{self.location_id}}}); result.item = items[1].item")
+        self.assertEqual(result["item"], self.location_id)
+
+    def test_await_scout_empty(self) -> None:
+        result = self.run_coroutine("result.count = #client:await_scout({})")
+        self.assertEqual(result["count"], 0)
+
+    def test_await_scout_subset(self) -> None:
+        # a plain LocationScouts reply for some of the locations does not resume the coroutine
+        got_info = []
+        self.call("set_location_info_handler", lambda items: got_info.append(items[1]["location"]))
+        self.call("LocationScouts", self.lua.table(self.location_id))
+        result = self.run_coroutine(
+            f"local items = client:await_scout({{{self.location_id}, {self.location_id + 1}}}); result.count = #items"
+        )
+        self.assertEqual(result["count"], 2)
+        self.assertEqual(got_info, [self.location_id])
+
+    def test_main_thread(self) -> None:
+        with self.assertRaises(LuaError) as ctx:
+            self.call("await_get", self.lua.table("a"))
+        self.assertIn("must be called from a coroutine", str(ctx.exception))
+        self.assertEqual(self.call("get_metrics")["queues"]["pending_requests"], 0)
+
+    @skipIf(is_jit or lua_version in ("5.1", "5.2"), "lua_isyieldable requires Lua 5.3+")
+    def test_not_yieldable(self) -> None:
+        # the comparator is called from C, so it can not yield
+        ok, err = self.lua.eval("""function(client)
+            return coroutine.wrap(function()
+                return pcall(table.sort, {1, 2}, function() client:await_get({'a'}); return false end)
+            end)()
+        end""")(self.client)
+        self.assertFalse(ok)
+        self.assertIn("yieldable", err)
+        self.assertEqual(self.call("get_metrics")["queues"]["pending_requests"], 0)
+
+
+class TestAwaitNotConnected(NotConnectedTestCase):
+    def test_call(self) -> None:
+        result = self.lua.eval("function(client) return coroutine.wrap(function() return client:await_get({'a'}) end)() end")(
+            self.client
+        )
+        self.assertIsNone(result)
+
+
 class TestSetNotifyNotConnected(NotConnectedTestCase):
     def test_call(self) -> None:
         res = self.call(
@@ -37,6 +37,10 @@ class SocketState(Enum):
 class ConnectionTest(ClientTestCase):
     socket_state: SocketState = SocketState.NONE
     server: WSServer
+    cert_store: Optional[str] = None
+
+    def create_client(self) -> LuaTable:
+        return self.apclient(self.uuid, self.game, self.uri, self.cert_store)
 
     def start_server(self, cert: str = "", key: str = "") -> int:
         ssl_context: Optional[ssl.SSLContext] = None
@@ -170,3 +174,27 @@ class ConnectionTest(ClientTestCase):
         self.connect()
         for _ in TimeoutLoop(lambda: self.socket_state != SocketState.CONNECTED, timeout=1):
             self.poll()
+
+    # Test connection behavior for server using TLS with certificate from a custom cert store
+    @skipIf(local_ip == "127.0.0.1", "Could not get local IP address")
+    @skipIf(not os.path.exists("untrusted.pem"), "Please generate untrusted.pem")
+    def test_wss_connect_ok_with_cert_store(self) -> None:
+        port = self.start_server("untrusted.pem", "untrusted-key.pem")
+        self.uri = f"wss://{local_ip}:{port}"
+        self.cert_store = "untrusted.pem"
+        self.connect()
+        for _ in TimeoutLoop(lambda: self.socket_state != SocketState.CONNECTED, timeout=1):
+            self.poll()
+
+    @skipIf(local_ip == "127.0.0.1", "Could not get local IP address")
+    @skipIf(not os.path.exists("untrusted.pem"), "Please generate untrusted.pem")
+    def test_wss_connect_ok_with_default_cert_store(self) -> None:
+        port = self.start_server("untrusted.pem", "untrusted-key.pem")
+        self.uri = f"wss://{local_ip}:{port}"
+        self.apclient["set_default_cert_store"]("untrusted.pem")
+        try:
+            self.connect()
+        finally:
+            self.apclient["set_default_cert_store"](None)
+        for _ in TimeoutLoop(lambda: self.socket_state != SocketState.CONNECTED, timeout=1):
+            self.poll()
@@ -0,0 +1,84 @@
+from typing import Any
+
+from .bases import E2ETestCase
+from .util import LuaError, LuaTable, TimeoutLoop
+
+
+class GroupTestCase(E2ETestCase):
+    group: LuaTable
+
+    def group_call(self, name: str, *args: Any) -> Any:
+        return self.group[name](self.group, *args)
+
+    def poll_group(self) -> None:
+        self.server.check()
+        self.group_call("poll")
+
+    def setUp(self) -> None:
+        super().setUp()
+        self.group = self.apclient["group"]()
+
+    def tearDown(self) -> None:
+        if hasattr(self, "group"):
+            del self.group  # holds a reference to the client
+        super().tearDown()
+
+
+class TestGroup(GroupTestCase):
+    done = False
+
+    def on_print(self, message: str) -> None:
+        super().on_print(message)
+        if "Hello, World!" in message:
+            self.done = True
+
+    def test_poll(self) -> None:
+        self.assertTrue(self.group_call("add", self.client))
+        self.server.print_all("Hello, World!")
+        for _ in TimeoutLoop(lambda: not self.done):
+            self.poll_group()
+
+    def test_add_remove(self) -> None:
+        self.assertTrue(self.group_call("add", self.client))
+        self.assertFalse(self.group_call("add", self.client))
+        self.assertEqual(self.group_call("size"), 1)
+        self.assertTrue(self.group_call("remove", self.client))
+        self.assertFalse(self.group_call("remove", self.client))
+        self.assertEqual(self.group_call("size"), 0)
+
+    def test_worker_threads(self) -> None:
+        other = self.create_client()
+        room_info = self.apclient["State"]["ROOM_INFO"]
+        try:
+            self.group_call("set_worker_threads", 2)
+            self.assertTrue(self.group_call("add", self.client))
+            self.assertTrue(self.group_call("add", other))
+            self.server.print_all("Hello, World!")
+            for _ in TimeoutLoop(lambda: not self.done or other["get_state"](other) < room_info):
+                self.poll_group()
+        finally:
+            self.group_call("remove", other)
+            del other
+
+    def test_bad_worker_threads(self) -> None:
+        with self.assertRaises(LuaError):
+            self.group_call("set_worker_threads", -1)
+
+    def test_poll_empty(self) -> None:
+        self.assertTrue(self.group_call("poll"))
+
+    def test_bad_client(self) -> None:
+        with self.assertRaises(LuaError):
+            self.group_call("add", self.lua.table())
+
+
+class TestBadGroupPoll(GroupTestCase):
+    def on_print(self, message: str) -> None:
+        raise RuntimeError("OK")
+
+    def test_error(self) -> None:
+        self.group_call("add", self.client)
+        self.server.print_all("Hello, World!")
+        with self.assertRaises(LuaError):
+            for _ in TimeoutLoop(lambda: True):
+                self.poll_group()
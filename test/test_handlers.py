@@ -1,7 +1,8 @@
+from typing import Any
 from unittest import skipIf
 
 from .bases import ClientTestCase, E2ETestCase
-from .util import LuaError, LuaTable, TimeoutLoop
+from .util import LuaError, LuaTable, TimeoutLoop, is_jit, lua_version
 
 
 class Bases:
@@ -332,3 +333,150 @@ class TestOnDataPackageChanged(E2ETestCase):
 class TestBadOnDataPackageChanged(Bases.BadSetUpTest):
     def on_data_package_changed(self, data_package: LuaTable) -> None:
         raise RuntimeError("OK")
+
+
+@skipIf(is_jit or lua_version == "5.1", "yieldable handlers require Lua 5.2+")
+class TestYieldableHandlers(E2ETestCase):
+    location_id = 2**32
+    yielded: Any = None
+
+    def create_client(self) -> LuaTable:
+        # the client has to be created and polled from the same coroutine
+        self.poller = self.lua.eval("""function(APClient, uuid, game, uri)
+            return coroutine.create(function()
+                local client = APClient(uuid, game, uri)
+                coroutine.yield(client)
+                while true do
+                    coroutine.yield(client:poll())
+                end
+            end)
+        end""")(self.apclient, self.uuid, self.game, self.uri)
+        client: LuaTable = self.resume()
+        self.assertTrue(client["set_yieldable_handlers"](client, True))
+        return client
+
+    def resume(self) -> Any:
+        ok, res = self.lua.eval("function(co) local ok, res = coroutine.resume(co); return ok, res end")(self.poller)
+        if not ok:
+            raise LuaError(res)
+        return res
+
+    def poll(self) -> None:
+        self.server.check()
+        self.yielded = self.resume()
+
+    def tearDown(self) -> None:
+        if hasattr(self, "poller"):
+            del self.poller  # holds a reference to the client
+        super().tearDown()
+
+    def test_yield(self) -> None:
+        result = self.lua.table()
+        handler = self.lua.eval("""function(result)
+            return function(locations)
+                coroutine.yield("handler")
+                result.location = locations[1]
+            end
+        end""")(result)
+        self.call("set_location_checked_handler", handler)
+        self.call("LocationChecks", self.lua.table(self.location_id))
+        for _ in TimeoutLoop(lambda: self.yielded != "handler"):
+            self.poll()
+        self.assertIsNone(result["location"])
+        self.poll()  # continues the handler and the rest of the poll
+        self.assertEqual(result["location"], self.location_id)
+        self.assertIs(self.yielded, True)
+
+    def test_poll_from_handler(self) -> None:
+        result = self.lua.table()
+        handler = self.lua.eval("""function(client, result)
+            return function(locations)
+                result.ok, result.err = pcall(client.poll, client)
+            end
+        end""")(self.client, result)
+        self.call("set_location_checked_handler", handler)
+        self.call("LocationChecks", self.lua.table(self.location_id))
+        for _ in TimeoutLoop(lambda: result["ok"] is None):
+            self.poll()
+        self.assertFalse(result["ok"])
+        self.assertIn("handler", result["err"])
+
+    def test_budget(self) -> None:
+        reports = []
+        handler = self.lua.eval("""function(locations)
+            local t = os.clock()
+            while os.clock() - t < 0.01 do end
+        end""")
+        self.call("set_location_checked_handler", handler)
+        self.call("set_handler_budget", 0.001, lambda name, duration: reports.append((name, duration)))
+        self.call("LocationChecks", self.lua.table(self.location_id))
+        for _ in TimeoutLoop(lambda: not reports):
+            self.poll()
+        self.assertEqual(reports[0][0], "location_checked_handler")
+        self.assertGreaterEqual(reports[0][1], 0.01)
+
+
+class TestHandlerStats(E2ETestCase):
+    def test_stats(self) -> None:
+        self.sync()
+        self.assertEqual(len(list(self.call("get_stats").keys())), 0)  # disabled by default
+        self.call("set_stats_enabled", True)
+        self.sync()
+        stats = self.call("get_stats")["items_received_handler"]
+        self.assertEqual(stats["calls"], 1)
+        self.assertEqual(stats["errors"], 0)
+        self.assertGreaterEqual(stats["avg_time"], stats["min_time"])
+        self.assertGreaterEqual(stats["max_time"], stats["p99_time"])
+        self.assertEqual(sum(stats["histogram"].values()), 1)
+        self.call("reset_stats")
+        self.assertEqual(len(list(self.call("get_stats").keys())), 0)
+
+    def test_errors(self) -> None:
+        def on_items_received(items: LuaTable) -> None:
+            raise RuntimeError("OK")
+
+        self.call("set_stats_enabled", True)
+        self.call("set_items_received_handler", on_items_received)
+        self.call("Sync")
+        with self.assertRaises(LuaError):
+            for _ in TimeoutLoop(lambda: True):
+                self.poll()
+        stats = self.call("get_stats")["items_received_handler"]
+        self.assertEqual(stats["calls"], 1)
+        self.assertEqual(stats["errors"], 1)
+
+    def test_metrics(self) -> None:
+        self.sync()
+        metrics = self.call("get_metrics")
+        self.assertGreater(metrics["polls"], 0)
+        self.assertGreaterEqual(metrics["events"]["items_received"], 1)
+        self.assertGreaterEqual(metrics["poll_time"], metrics["max_poll_time"])
+        self.assertGreaterEqual(metrics["poll_time"], metrics["event_time"])
+        self.assertEqual(metrics["queues"]["events"], 0)
+        self.assertEqual(metrics["queues"]["pending_requests"], 0)
+
+
+class TestHandlerBudget(E2ETestCase):
+    def test_budget(self) -> None:
+        reports = []
+        self.call("set_stats_enabled", True)
+        self.call("set_handler_budget", 1e-9, lambda name, duration: reports.append((name, duration)))
+        self.sync()
+        self.assertEqual(len(reports), 1)
+        self.assertEqual(reports[0][0], "items_received_handler")
+        self.assertGreater(reports[0][1], 0)
+        self.assertEqual(self.call("get_stats")["items_received_handler"]["over_budget"], 1)
+
+    def test_disabled(self) -> None:
+        reports = []
+        self.call("set_handler_budget", 1e-9, lambda name, duration: reports.append(name))
+        self.call("set_handler_budget", None)
+        self.sync()
+        self.assertEqual(reports, [])
+        self.call("set_handler_budget", 3600, lambda name, duration: reports.append(name))
+        self.sync()
+        self.assertEqual(reports, [])
+
+    def test_bad_args(self) -> None:
+        with self.assertRaises(LuaError):
+            self.call("set_handler_budget", -1)
@@ -1,5 +1,5 @@
 from .bases import E2ETestCase, ClientTestCase
-from .util import LuaError
+from .util import LuaError, TimeoutLoop
 
 
 class TestProperties(E2ETestCase):
@@ -160,6 +160,33 @@ class TestProperties(E2ETestCase):
         with self.assertRaises(LuaError):
             self.client["get_permission"](self.lua.table(), self.lua.table())
 
+    def test_memory_usage(self) -> None:
+        usage = self.call("get_memory_usage")
+        categories = ["data_package", "item_log", "location_sets", "storage", "pending", "diagnostics"]
+        for category in categories:
+            self.assertGreaterEqual(usage[category], 0)
+        self.assertEqual(usage["total"], sum(usage[category] for category in categories))
+
+    def test_memory_usage_grows(self) -> None:
+        before = self.call("get_memory_usage")
+        # received items are kept while the item log is enabled
+        synced = []
+        self.call("set_items_received_handler", lambda items: synced.append(True))
+        self.call("set_item_log_enabled", True)
+        self.assertTrue(self.call("Sync"))
+        for _ in TimeoutLoop(lambda: not synced):
+            self.poll()
+        # spans of the next poll
+        self.call("set_tracing", 100)
+        self.poll()
+        # a request waiting for its reply, not polled afterwards
+        self.assertTrue(self.call("Get", self.lua.table("a"), lambda *args: None))
+        after = self.call("get_memory_usage")
+        self.assertGreater(after["item_log"], before["item_log"])
+        self.assertGreater(after["pending"], before["pending"])
+        self.assertGreater(after["diagnostics"], before["diagnostics"])
+        self.assertGreater(after["total"], before["total"])
+
     def test_checked_locations(self) -> None:
         # FIXME: this is currently empty
         for k, v in self.client["checked_locations"].items():
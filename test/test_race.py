@@ -0,0 +1,145 @@
+import socket
+from threading import Thread
+from typing import Any, List, Optional
+
+from .bases import ClientTestCase
+from .server import APServer
+from .util import LuaError, LuaTable, TimeoutLoop
+
+
+class HoldTLSProxy(Thread):
+    """Forwards plain connections to port and holds TLS connections open without answering, to count when they close"""
+    tls_opened = 0
+    tls_closed = 0
+
+    def __init__(self, port: int) -> None:
+        super().__init__(daemon=True)
+        self.target = port
+        self.sock = socket.create_server(("localhost", 0))
+        self.sock.settimeout(0.1)
+        self.port = self.sock.getsockname()[1]
+        self.running = True
+        self.conns: List[socket.socket] = []
+
+    def run(self) -> None:
+        while self.running:
+            try:
+                conn, _ = self.sock.accept()
+            except socket.timeout:
+                continue
+            self.conns.append(conn)
+            Thread(target=self.handle, args=(conn,), daemon=True).start()
+
+    def stop(self) -> None:
+        self.running = False
+        self.join()
+        for conn in self.conns:
+            conn.close()
+        self.sock.close()
+
+    def handle(self, conn: socket.socket) -> None:
+        first = conn.recv(1, socket.MSG_PEEK)
+        if first == b"\x16":  # TLS handshake
+            self.tls_opened += 1
+            try:
+                while conn.recv(4096):
+                    pass
+            except OSError:
+                pass
+            self.tls_closed += 1
+            return
+        upstream = socket.create_connection(("localhost", self.target))
+        self.conns.append(upstream)
+        Thread(target=self.pipe, args=(upstream, conn), daemon=True).start()
+        self.pipe(conn, upstream)
+
+    @staticmethod
+    def pipe(src: socket.socket, dst: socket.socket) -> None:
+        try:
+            while True:
+                data = src.recv(4096)
+                if not data:
+                    break
+                dst.sendall(data)
+        except OSError:
+            pass
+
+
+class TestRace(ClientTestCase):
+    server: APServer
+    race: Any = None
+    winner: Optional[LuaTable] = None
+
+    def setUp(self) -> None:
+        super().setUp()
+        self.server = APServer()
+        self.server.start()
+        for _ in TimeoutLoop(lambda: self.server.port == 0):
+            pass
+
+    def tearDown(self) -> None:
+        self.race = None
+        self.winner = None
+        self.lua.gccollect()
+        super().tearDown()
+        self.server.stop()
+
+    def start_race(self, host: str, *args: Any) -> None:
+        self.race = self.apclient["race"](self.uuid, self.game, host, *args)
+
+    def poll_race(self) -> None:
+        self.server.check()
+        self.winner = self.race["poll"](self.race)
+
+    def assert_winner(self) -> None:
+        for _ in TimeoutLoop(lambda: self.winner is None):
+            self.poll_race()
+        assert self.winner is not None
+        self.assertGreaterEqual(self.winner["get_state"](self.winner), self.apclient["State"]["ROOM_INFO"])
+        # polling again returns the same client
+        winner = self.winner
+        self.poll_race()
+        self.assertEqual(self.winner, winner)
+
+    def test_without_scheme(self) -> None:
+        self.start_race(f"localhost:{self.server.port}", 0.1)
+        self.assert_winner()
+
+    def test_with_scheme(self) -> None:
+        self.start_race(f"ws://localhost:{self.server.port}")
+        self.assert_winner()
+
+    def test_connection_events(self) -> None:
+        self.start_race(f"ws://localhost:{self.server.port}")
+        self.assert_winner()
+        assert self.winner is not None
+        events = []
+        self.winner["set_socket_connected_handler"](self.winner, lambda: events.append("socket_connected"))
+        self.winner["set_room_info_handler"](self.winner, lambda: events.append("room_info"))
+        self.winner["poll"](self.winner)
+        self.assertEqual(events, ["socket_connected", "room_info"])
+        # only replayed once
+        self.winner["poll"](self.winner)
+        self.assertEqual(events, ["socket_connected", "room_info"])
+
+    def test_loser_closed(self) -> None:
+        proxy = HoldTLSProxy(self.server.port)
+        proxy.start()
+        try:
+            self.start_race(f"localhost:{proxy.port}", 0.1)
+            self.assert_winner()
+            # wss was started first and is held open by the proxy until the race closes it
+            for _ in TimeoutLoop(lambda: proxy.tls_closed == 0):
+                self.poll_race()
+            self.assertEqual(proxy.tls_closed, proxy.tls_opened)
+        finally:
+            self.race = None
+            self.winner = None
+            self.lua.gccollect()
+            proxy.stop()
+
+    def test_bad_args(self) -> None:
+        with self.assertRaises(LuaError):
+            self.apclient["race"](self.uuid, self.game)
+        with self.assertRaises(LuaError):
+            self.start_race("localhost", "soon")
@@ -1,3 +1,5 @@
+import time
+
 from test.bases import E2ETestCase, ClientTestCase
 from test.util import LuaError, TimeoutLoop
 
@@ -15,11 +17,63 @@ class TestReset(E2ETestCase):
         for _ in TimeoutLoop(lambda: not self.done, timeout=3.5):
             self.poll()
 
+    def test_connection_stats(self) -> None:
+        stats = self.call("get_connection_stats")
+        self.assertEqual(stats["connects"], 1)
+        self.assertEqual(stats["reconnects"], 0)
+        self.assertGreaterEqual(stats["attempts"], 1)
+        self.assertGreaterEqual(stats["last_connect_time"], 0)
+        self.done = False
+        self.call("reset")
+        for _ in TimeoutLoop(lambda: not self.done, timeout=3.5):
+            self.poll()
+        stats = self.call("get_connection_stats")
+        self.assertEqual(stats["connects"], 2)
+        self.assertEqual(stats["reconnects"], 1)
+        self.assertGreaterEqual(stats["attempts"], 2)
+
     def test_bad_call(self) -> None:
         with self.assertRaises(LuaError):
             self.client["reset"](self.lua.table())
 
 
+class TestReconnectPolicy(E2ETestCase):
+    def test_delay(self) -> None:
+        self.call("set_reconnect_policy", self.lua.table(min_delay=1, jitter=0))
+        self.got_room_info = False
+        start = time.monotonic()
+        self.server._connections[0].connection.close()
+        for _ in TimeoutLoop(lambda: not self.got_room_info, timeout=5):
+            self.poll()
+        self.assertGreaterEqual(time.monotonic() - start, 1)
+        self.assertEqual(self.call("get_connection_stats")["reconnects"], 1)
+
+    def test_disable(self) -> None:
+        self.call("set_reconnect_policy", self.lua.table(min_delay=30, jitter=0))
+        self.got_room_info = False
+        attempts = self.call("get_connection_stats")["attempts"]
+        self.server._connections[0].connection.close()
+        # held back by the policy
+        start = time.monotonic()
+        while time.monotonic() - start < 0.5:
+            self.poll()
+        self.assertEqual(self.call("get_connection_stats")["attempts"], attempts)
+        self.assertFalse(self.got_room_info)
+        # the default reconnects without waiting for the policy
+        self.call("set_reconnect_policy", None)
+        for _ in TimeoutLoop(lambda: not self.got_room_info, timeout=5):
+            self.poll()
+        self.assertGreater(self.call("get_connection_stats")["attempts"], attempts)
+
+    def test_bad_policy(self) -> None:
+        with self.assertRaises(LuaError):
+            self.call("set_reconnect_policy", 1)
+        with self.assertRaises(LuaError):
+            self.call("set_reconnect_policy", self.lua.table(min_delay=2, max_delay=1))
+        with self.assertRaises(LuaError):
+            self.call("set_reconnect_policy", self.lua.table(jitter=2))
+
+
 class TestResetNotConnected(ClientTestCase):
     def setUp(self) -> None:
         super().setUp()
@@ -0,0 +1,105 @@
+from .bases import E2ETestCase, NotConnectedTestCase
+from .util import LuaError, LuaTable, TimeoutLoop
+
+
+class TestState(E2ETestCase):
+    items_received = 0
+    bounced = False
+
+    def setUp(self) -> None:
+        self.path = self.temp_path("state.bin")
+        super().setUp()
+
+    def on_items_received(self, items: LuaTable) -> None:
+        self.items_received += 1
+
+    def on_bounced(self, command: LuaTable) -> None:
+        self.bounced = True
+
+    def sync(self) -> None:
+        # the item log can filter out all items, so wait for a bounce instead of ReceivedItems
+        self.items_received = 0
+        self.assertTrue(self.call("Sync"))
+        self.wait_handled()
+
+    def wait_handled(self) -> None:
+        # the bounce arrives after everything sent before it
+        self.bounced = False
+        self.call("Bounce", self.lua.table(), None, self.lua.table(self.call("get_player_number")), None)
+        for _ in TimeoutLoop(lambda: not self.bounced):
+            self.poll()
+
+    def test_resume(self) -> None:
+        self.call("set_item_log_enabled", True)
+        self.sync()
+        self.assertEqual(self.items_received, 1)
+        self.call("save_state", self.path)
+        self.call("load_state", self.path)
+        self.sync()
+        self.assertEqual(self.items_received, 0)
+
+    def test_resume_new_client(self) -> None:
+        self.call("set_item_log_enabled", True)
+        self.sync()
+        self.call("save_state", self.path)
+        del self.client
+        self.lua.gccollect()
+        self.got_room_info = False
+        self.slot_connected = False
+        self.items_received = 0
+        self.connect()
+        self.call("load_state", self.path)
+        self.wait_room_info()
+        self._connect_slot()
+        self.wait_slot_connected()
+        self.wait_handled()
+        self.assertEqual(self.items_received, 0)
+
+    def test_enable_connected(self) -> None:
+        self.sync()
+        self.items_received = 0
+        # items received before are requested again, but not passed to the handler again
+        self.call("set_item_log_enabled", True)
+        self.wait_handled()
+        self.assertEqual(self.items_received, 0)
+        self.assertGreater(self.call("get_memory_usage")["item_log"], 0)
+        self.call("save_state", self.path)
+        self.call("load_state", self.path)
+        self.sync()
+        self.assertEqual(self.items_received, 0)
+
+    def test_no_resume(self) -> None:
+        self.call("save_state", self.path)
+        self.call("load_state", self.path)
+        self.sync()
+        self.assertEqual(self.items_received, 1)
+
+    def test_no_log(self) -> None:
+        self.sync()
+        self.assertEqual(self.items_received, 1)
+        self.call("save_state", self.path)
+        self.sync()
+        self.assertEqual(self.call("get_memory_usage")["item_log"], 0)
+        self.call("set_item_log_enabled", True)
+        self.sync()
+        self.assertGreater(self.call("get_memory_usage")["item_log"], 0)
+        self.call("set_item_log_enabled", False)
+        self.assertEqual(self.call("get_memory_usage")["item_log"], 0)
+
+    def test_bad_file(self) -> None:
+        with open(self.path, "wb") as f:
+            f.write(b"APCS\x01\x00\x00\x00\x04")
+        with self.assertRaises(LuaError):
+            self.call("load_state", self.path)
+        with self.assertRaises(LuaError):
+            self.call("load_state", self.temp_path("missing.bin"))
+        with self.assertRaises(LuaError):
+            self.call("load_state")
+
+
+class TestStateNotConnected(NotConnectedTestCase):
+    def test_roundtrip(self) -> None:
+        path = self.temp_path("state.bin")
+        self.call("save_state", path)
+        checksums = self.call("load_state", path)
+        self.assertEqual(sum(1 for _ in checksums.keys()), 0)
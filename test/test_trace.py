@@ -0,0 +1,51 @@
+import json
+import os
+
+from .bases import E2ETestCase
+from .util import LuaError
+
+
+class TestTrace(E2ETestCase):
+    def setUp(self) -> None:
+        self.path = self.temp_path("trace.json")
+        super().setUp()
+
+    def load(self) -> list:
+        with open(self.path, encoding="utf-8") as f:
+            return json.load(f)["traceEvents"]
+
+    def test_trace(self) -> None:
+        self.call("set_tracing", 1000)
+        self.sync()
+        count = self.call("dump_trace", self.path)
+        spans = self.load()
+        self.assertEqual(len(spans), count)
+        names = {span["name"] for span in spans}
+        self.assertIn("poll", names)
+        self.assertIn("Sync", names)
+        self.assertIn("items_received", names)
+        self.assertIn("items_received_handler", names)
+        for span in spans:
+            self.assertEqual(span["ph"], "X")
+            self.assertGreaterEqual(span["dur"], 0)
+
+    def test_ring_buffer(self) -> None:
+        self.call("set_tracing", 3)
+        for _ in range(10):
+            self.poll()
+        self.assertEqual(self.call("dump_trace", self.path), 3)
+        self.assertEqual(len(self.load()), 3)
+
+    def test_disabled(self) -> None:
+        self.sync()
+        self.assertEqual(self.call("dump_trace", self.path), 0)
+        self.call("set_tracing", 10)
+        self.poll()
+        self.call("set_tracing", None)
+        self.assertEqual(self.call("dump_trace", self.path), 0)
+
+    def test_bad_args(self) -> None:
+        with self.assertRaises(LuaError):
+            self.call("set_tracing", -1)
+        with self.assertRaises(LuaError):
+            self.call("dump_trace", self.temp_path(os.path.join("missing", "trace.json")))
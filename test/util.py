@@ -73,7 +73,7 @@ LuaTable = MutableMapping[Union[int, str], Any]
 
 class LuaAPClient(MutableMapping[str, Any], ABC):
     @abstractmethod
-    def __call__(self, uuid: str, game: str, host: str) -> LuaTable:
+    def __call__(self, uuid: str, game: str, host: str, cert_store: Optional[str] = None) -> LuaTable:
         ...
 
 